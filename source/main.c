@@ -20,12 +20,249 @@
 #include <avr/interrupt.h>
 #include <avr/io.h>
 #include <avr/pgmspace.h>
+#include <avr/sleep.h>
 #include <avr/wdt.h>
 #include <util/delay.h>
 #include <stdlib.h>
 
 #include "usbdrv/usbdrv.h"
 
+/* ----------------------------- build options ----------------------------- */
+
+/* These are normally set from the Makefile, eg. "make USE_PROFILER=1" */
+
+#ifndef USE_PROFILER
+#define USE_PROFILER    0           /* sampling PC profiler, see tools/tasta-profile */
+#endif
+
+#ifndef USE_REPORT_TABLE
+#define USE_REPORT_TABLE 0          /* arm interrupt reports from precomputed packets */
+#endif
+
+#ifndef USE_JIT_REPORT
+#define USE_JIT_REPORT  0           /* sample the buttons when the host polls */
+#endif
+
+#ifndef USE_POLL_SYNC
+#define USE_POLL_SYNC   0           /* arm reports just before the predicted host poll */
+#endif
+
+#ifndef USE_IDLE_SLEEP
+#define USE_IDLE_SLEEP  0           /* sleep in the main loop when there is nothing to do */
+#endif
+
+#ifndef USE_KEY_LADDER
+#define USE_KEY_LADDER  0           /* resistor ladders on the button pins, read by the ADC */
+#endif
+
+#ifndef LADDER_KEYS
+#define LADDER_KEYS     6           /* keys on each ladder, up to 8 */
+#endif
+
+#ifndef USE_PEDAL_AXIS
+#define USE_PEDAL_AXIS  0           /* potentiometer on a button pin, reported as an axis */
+#endif
+
+#ifndef PEDAL_BUTTON
+#define PEDAL_BUTTON    2           /* pin of this button reads the pedal */
+#endif
+
+#ifndef USE_RAPID_TRIGGER
+#define USE_RAPID_TRIGGER 0         /* Hall effect switch on button 1, rapid trigger */
+#endif
+
+#ifndef USE_TAP_HOLD
+#define USE_TAP_HOLD    0           /* tap for a key, hold for a modifier */
+#endif
+
+#ifndef TAPPING_TERM
+#define TAPPING_TERM    200         /* ms a key has to be held to count as held */
+#endif
+
+#define TAP_HOLD_BY_TIME    0       /* TAP_HOLD_POLICY: only the tapping term decides */
+#define TAP_HOLD_PERMISSIVE 1       /* a tap of the other key while undecided makes a hold */
+#define TAP_HOLD_ON_OTHER   2       /* pressing the other key while undecided makes a hold */
+
+#ifndef TAP_HOLD_POLICY
+#define TAP_HOLD_POLICY TAP_HOLD_PERMISSIVE
+#endif
+
+#ifndef TAP_HOLD_SPECULATIVE
+#define TAP_HOLD_SPECULATIVE 3      /* keys whose hold is reported at once, bit 0 = button 1 */
+#endif
+
+#ifndef USE_CHORDS
+#define USE_CHORDS      0           /* both buttons pressed together send their own binding */
+#endif
+
+#ifndef CHORD_WINDOW
+#define CHORD_WINDOW    8           /* ms a single press is held back waiting for the other button */
+#endif
+
+#ifndef CHORD_RETRACT
+#define CHORD_RETRACT   50          /* ms the other button may come late and retract the first */
+#endif
+
+#ifndef USE_TURBO
+#define USE_TURBO       0           /* held keys send press and release reports in turn */
+#endif
+
+#ifndef TURBO_KEYS
+#define TURBO_KEYS      2           /* keys that repeat from the press on, bit 0 = button 1 */
+#endif
+
+#ifndef REPEAT_KEYS
+#define REPEAT_KEYS     0           /* keys that repeat after REPEAT_DELAY */
+#endif
+
+#ifndef TURBO_RATE
+#define TURBO_RATE      20          /* presses per second */
+#endif
+
+#ifndef REPEAT_DELAY
+#define REPEAT_DELAY    300         /* ms before a REPEAT_KEYS key starts to repeat */
+#endif
+
+#ifndef USE_LATCH
+#define USE_LATCH       0           /* a press latches a key down, the next one lets it go */
+#endif
+
+#ifndef USE_HANG
+#define USE_HANG        0           /* releases are reported late, presses at once */
+#endif
+
+#ifndef HANG_TIME1
+#define HANG_TIME1      250         /* ms button 1 stays down after its release */
+#endif
+
+#ifndef HANG_TIME2
+#define HANG_TIME2      0           /* same for button 2 */
+#endif
+
+#ifndef USE_MULTI_TAP
+#define USE_MULTI_TAP   0           /* single, double and triple taps of button 2 differ */
+#endif
+
+#ifndef MULTI_TAP_WINDOW
+#define MULTI_TAP_WINDOW 250        /* ms from a release to the next tap of the same series */
+#endif
+
+#ifndef MULTI_TAP_IMMEDIATE
+#define MULTI_TAP_IMMEDIATE 0       /* send the single tap at once, correct it on the next */
+#endif
+
+#ifndef USE_PROFILES
+#define USE_PROFILES    0           /* keymap profiles switched at runtime, see keymapTable */
+#endif
+
+#ifndef USE_LED_PWM
+#define USE_LED_PWM     0           /* LED dimmed by Timer0 PWM, status patterns */
+#endif
+
+#ifndef USE_GAMEPAD
+#define USE_GAMEPAD     0           /* a gamepad with 8 buttons instead of a keyboard */
+#endif
+
+#ifndef USE_EEPROM_INTERVAL
+#define USE_EEPROM_INTERVAL 0       /* bInterval of the interrupt endpoint from EEPROM */
+#endif
+
+#ifndef LED_BRIGHTNESS
+#define LED_BRIGHTNESS  64          /* LED on time in 1/256 with USE_LED_PWM */
+#endif
+
+#if USE_JIT_REPORT && !USE_REPORT_TABLE
+#error "USE_JIT_REPORT needs USE_REPORT_TABLE"
+#endif
+
+#if USE_KEY_LADDER && USE_REPORT_TABLE
+#error "USE_REPORT_TABLE can't hold the packets for all ladder keys"
+#endif
+
+#if USE_KEY_LADDER && (LADDER_KEYS < 1 || LADDER_KEYS > 8)
+#error "LADDER_KEYS must be 1 to 8"
+#endif
+
+#if USE_PEDAL_AXIS && (USE_KEY_LADDER || USE_REPORT_TABLE || USE_POLL_SYNC)
+#error "USE_PEDAL_AXIS does not go with USE_KEY_LADDER, USE_REPORT_TABLE or USE_POLL_SYNC"
+#endif
+
+#if USE_PEDAL_AXIS && PEDAL_BUTTON != 1 && PEDAL_BUTTON != 2
+#error "PEDAL_BUTTON must be 1 or 2"
+#endif
+
+/* USE_JIT_REPORT reads the buttons from PINB, the Hall sensor pin has its
+ * digital input switched off */
+#if USE_RAPID_TRIGGER && (USE_KEY_LADDER || USE_PEDAL_AXIS || USE_JIT_REPORT)
+#error "USE_RAPID_TRIGGER does not go with USE_KEY_LADDER, USE_PEDAL_AXIS or USE_JIT_REPORT"
+#endif
+
+#if USE_TAP_HOLD && (USE_KEY_LADDER || USE_REPORT_TABLE)
+#error "USE_TAP_HOLD does not go with USE_KEY_LADDER or USE_REPORT_TABLE"
+#endif
+
+#if USE_CHORDS && (USE_KEY_LADDER || USE_REPORT_TABLE || USE_TAP_HOLD)
+#error "USE_CHORDS does not go with USE_KEY_LADDER, USE_REPORT_TABLE or USE_TAP_HOLD"
+#endif
+
+#if USE_CHORDS && CHORD_RETRACT < CHORD_WINDOW
+#error "CHORD_RETRACT can't be shorter than CHORD_WINDOW"
+#endif
+
+#if USE_TURBO && (USE_REPORT_TABLE || USE_POLL_SYNC)
+#error "USE_TURBO does not go with USE_REPORT_TABLE or USE_POLL_SYNC"
+#endif
+
+#if USE_TURBO && (TURBO_KEYS & REPEAT_KEYS)
+#error "a key can't be in TURBO_KEYS and REPEAT_KEYS"
+#endif
+
+#if USE_LATCH && (USE_KEY_LADDER || USE_REPORT_TABLE || USE_TAP_HOLD || USE_CHORDS)
+#error "USE_LATCH does not go with USE_KEY_LADDER, USE_REPORT_TABLE, USE_TAP_HOLD or USE_CHORDS"
+#endif
+
+#if USE_HANG && (USE_KEY_LADDER || USE_REPORT_TABLE || USE_TAP_HOLD || USE_CHORDS || USE_LATCH)
+#error "USE_HANG does not go with USE_KEY_LADDER, USE_REPORT_TABLE, USE_TAP_HOLD, USE_CHORDS or USE_LATCH"
+#endif
+
+#if USE_MULTI_TAP && (USE_KEY_LADDER || USE_REPORT_TABLE || USE_TAP_HOLD || USE_CHORDS || USE_LATCH || USE_HANG)
+#error "USE_MULTI_TAP does not go with USE_KEY_LADDER, USE_REPORT_TABLE, USE_TAP_HOLD, USE_CHORDS, USE_LATCH or USE_HANG"
+#endif
+
+#if USE_LED_PWM && USE_PROFILER
+#error "USE_LED_PWM and USE_PROFILER both need Timer0"
+#endif
+
+#if USE_LED_PWM && (LED_BRIGHTNESS < 1 || LED_BRIGHTNESS > 256)
+#error "LED_BRIGHTNESS must be 1 to 256"
+#endif
+
+#if USE_GAMEPAD && (USE_PEDAL_AXIS || USE_PROFILES)
+#error "USE_GAMEPAD does not go with USE_PEDAL_AXIS or USE_PROFILES"
+#endif
+
+#if USE_PROFILES && (USE_KEY_LADDER || USE_REPORT_TABLE || USE_TAP_HOLD || USE_CHORDS || USE_LATCH || USE_HANG || USE_MULTI_TAP)
+#error "USE_PROFILES does not go with USE_KEY_LADDER, USE_REPORT_TABLE, USE_TAP_HOLD, USE_CHORDS, USE_LATCH, USE_HANG or USE_MULTI_TAP"
+#endif
+
+/* 16.5 and 12.8 MHz come from the calibrated RC oscillator.  The other
+ * clocks V-USB supports need a crystal on PB3/PB4, where our buttons are:
+ * they are only built to compare the USB modules in the simulator.
+ */
+#define RC_OSCILLATOR   (F_CPU == 16500000 || F_CPU == 12800000)
+
+/* A low speed device has to answer within 7.5 bit times: 82 cycles at
+ * 16.5 MHz, 60 at 12.8 MHz.  By the cycle counts of asmcommon.inc and
+ * usbdrvasm*.inc the answer to an IN token on endpoint 1 starts 50 + 12 =
+ * 62 cycles after the SE0 with usbdrvasm165.inc and 50 + 10 = 60 with
+ * usbdrvasm128.inc.  usbJitReport in usbconfig.h takes 8 cycles instead of
+ * the 2 of the default path: 68 of 82 at 16.5 MHz, 66 of 60 at 12.8 MHz.
+ * The other clocks need a crystal on the button pins.
+ */
+#if USE_JIT_REPORT && F_CPU != 16500000
+#error "USE_JIT_REPORT only fits into the USB turnaround time at 16.5 MHz"
+#endif
+
 /* ----------------------- hardware I/O abstraction ------------------------ */
 
 /* pin assignments:
@@ -46,117 +283,1507 @@ PB5     reset (in hardware; unused here)
 #define BUTTON2_BIT     PB3         /* bit for button 2 in button register */
 #define LED_BIT         PB0         /* bit for LED in LED register */
 
+#if PEDAL_BUTTON == 1
+#define PEDAL_BIT       BUTTON1_BIT /* pin of the pedal with USE_PEDAL_AXIS */
+#define PEDAL_MUX       2           /* ADC2 = PB4 */
+#else
+#define PEDAL_BIT       BUTTON2_BIT
+#define PEDAL_MUX       3           /* ADC3 = PB3 */
+#endif
+
 #define KEY1            (1 << 0)    /* bitmask for key 1 */
 #define KEY2            (1 << 1)    /* bitmask for key 2 */
 
+/* button pins read by the ADC, without pull-up and pin change interrupt */
+#if USE_PEDAL_AXIS
+#define ANALOG_BITS     _BV(PEDAL_BIT)
+#elif USE_RAPID_TRIGGER
+#define ANALOG_BITS     _BV(BUTTON1_BIT)
+#else
+#define ANALOG_BITS     0
+#endif
+
+/* EEPROM layout */
+#define EEPROM_OSCCAL   ((uint8_t *)0)  /* calibration of the RC oscillator */
+#define EEPROM_RAPID    ((uint8_t *)1)  /* 4 bytes, see rapidInit() */
+#define EEPROM_LATCH    ((uint8_t *)5)  /* 2 bytes, see latchInit() */
+#define EEPROM_KEYMAP   ((uint8_t *)7)  /* 17 bytes, see keymapLoad() */
+#define EEPROM_INTERVAL ((uint8_t *)24) /* see configInit() */
+
+#if USE_KEY_LADDER
+#define NUM_KEYS        (2 * LADDER_KEYS) /* button 1 ladder first */
+#else
+#define NUM_KEYS        2
+#endif
+
+/* USE_TAP_HOLD: KEY1 and KEY2 stand for the taps, these for the holds */
+#define KEY1_HOLD       (1 << 2)
+#define KEY2_HOLD       (1 << 3)
+
+/* USE_CHORDS: both buttons together */
+#define KEY_CHORD       (1 << 4)
+
+/* USE_MULTI_TAP: taps of button 2, and the undo before an upgrade */
+#define KEY2_TAP1       (1 << 2)
+#define KEY2_TAP2       (1 << 3)
+#define KEY2_TAP3       (1 << 4)
+#define KEY2_UNDO       (1 << 5)
+
+/* one bit per key */
+#if NUM_KEYS > 8
+typedef uint16_t keys_t;
+#else
+typedef uchar keys_t;
+#endif
+
+#if USE_GAMEPAD && NUM_KEYS > 8
+#error "USE_GAMEPAD has 8 buttons, use at most 4 LADDER_KEYS"
+#endif
+
+#if USE_LED_PWM
+/* LED pin high, driven low by Timer0 for LED_BRIGHTNESS/256 while on */
+#define LED_ON      (TCCR0A |=  (_BV(COM0A1) | _BV(COM0A0)))
+#define LED_OFF     (TCCR0A &= ~(_BV(COM0A1) | _BV(COM0A0)))
+#else
 /* LED is controlled via pull-up: no pullup = acts as sink = LED on */
 #define LED_ON      (LED_PORT &= ~_BV(LED_BIT))
 #define LED_OFF     (LED_PORT |=  _BV(LED_BIT))
+#endif
 
 #define GET_BIT(pin,bit) (pin & _BV(bit))
 
+#if USE_PROFILER
+#define PROFILED        __attribute__((noinline)) /* keep function visible for the profiler */
+#else
+#define PROFILED
+#endif
 
-static void hardwareInit(void)
+
+/* ------------------------------------------------------------------------- */
+/* ---------------------------- Sampling Profiler -------------------------- */
+/* ------------------------------------------------------------------------- */
+
+#if USE_PROFILER
+
+/* Timer0 interrupts the main loop at ~1.3 kHz and grabs the interrupted
+ * program counter.  The main loop sorts the samples into a small histogram
+ * whose buckets are set up by the host from the symbol table of the current
+ * build (tools/tasta-profile), so no address knowledge is compiled in.
+ *
+ * The USB interrupt can not be sampled: our sample is taken as soon as it
+ * returns.  Everything we count is thus time spent outside of the USB ISR.
+ */
+
+#define PROFILE_BUCKETS     16      /* number of address buckets */
+#define PROFILE_OCR         ((uchar)(F_CPU / 64 / 1289) - 1) /* not in step with the 1 ms USB frames */
+
+#define RQ_PROFILE_BUCKET   1       /* wIndex: bucket, wValue: first word address, clears counters */
+#define RQ_PROFILE_READ     2       /* returns counters, then number of lost samples */
+
+/* written from the sampling interrupt, so these can't be static */
+volatile uint16_t profilePc;        /* word address of last sample */
+volatile uchar    profileSeq;       /* incremented on every sample */
+
+static uint16_t profileStart[PROFILE_BUCKETS];     /* first word address of each bucket, ascending */
+static uint16_t profileCount[PROFILE_BUCKETS + 1]; /* last entry counts lost samples */
+static uchar    profileSeen;
+
+/* The USB interrupt may nest right away: the sei delays it by the interrupt
+ * response, the jump from the vector and one instruction, well within what
+ * V-USB tolerates at every clock.  A nested USB interrupt has returned
+ * before we go on, so the return address on the stack is still ours: big
+ * endian, behind the 3 saved registers.
+ *
+ * A sample takes 40 cycles: 6 for the interrupt response and the vector,
+ * 30 for the code below and 4 for the reti.  At ~1289 samples a second
+ * that is 0.31 % of the CPU at 16.5 MHz, 0.40 % at 12.8 MHz, plus
+ * profileCollect() in the main loop.  The USB interrupt waits at most for
+ * the response, the vector, the sei and the first push: 9 cycles.
+ */
+ISR(TIM0_COMPA_vect, ISR_NAKED)
+{
+	asm volatile(
+		"sei"                       "\n\t"
+		"push r0"                   "\n\t"
+		"push r30"                  "\n\t"
+		"push r31"                  "\n\t"
+		"in   r30, __SP_L__"        "\n\t"
+		"in   r31, __SP_H__"        "\n\t"
+		"ldd  r0, Z+5"              "\n\t"
+		"sts  profilePc, r0"        "\n\t"
+		"ldd  r0, Z+4"              "\n\t"
+		"sts  profilePc+1, r0"      "\n\t"
+		"in   r31, __SREG__"        "\n\t"
+		"lds  r30, profileSeq"      "\n\t"
+		"inc  r30"                  "\n\t"
+		"sts  profileSeq, r30"      "\n\t"
+		"out  __SREG__, r31"        "\n\t"
+		"pop  r31"                  "\n\t"
+		"pop  r30"                  "\n\t"
+		"pop  r0"                   "\n\t"
+		"reti"                      "\n\t"
+		::);
+}
+
+static void profileInit(void)
 {
 	uchar i;
-	uchar calibrationValue;
 
-	calibrationValue = eeprom_read_byte(0); /* calibration value from last time */
-	if (calibrationValue != 0xff)
+	for (i = 0; i < PROFILE_BUCKETS; i++)
 	{
-		OSCCAL = calibrationValue;
+		profileStart[i] = 0xffff;
 	}
+	profileStart[0] = 0;
 
-	usbInit();
-	usbDeviceDisconnect();  /* enforce re-enumeration, do this while interrupts are disabled! */
-	i = 0;
-	while(--i){             /* fake USB disconnect for > 250 ms */
-		wdt_reset();
-		_delay_ms(1);
+	/* CTC mode, clock/64 */
+	OCR0A = PROFILE_OCR;
+	TCCR0A = _BV(WGM01);
+	TCCR0B = _BV(CS01) | _BV(CS00);
+	TIMSK |= _BV(OCIE0A);
+}
+
+/* called from the main loop: move the last sample into its bucket */
+static PROFILED void profileCollect(void)
+{
+	uint16_t pc;
+	uchar seq, i;
+
+	cli();
+	pc = profilePc;
+	seq = profileSeq;
+	sei();
+
+	if (seq == profileSeen)
+	{
+		return;
 	}
-	usbDeviceConnect();
 
-	wdt_enable(WDTO_1S);
+	/* more than one new sample: all but the last one are lost */
+	profileCount[PROFILE_BUCKETS] += (uchar)(seq - profileSeen - 1);
+	profileSeen = seq;
 
-	/* activate pull-ups for the buttons */
-	BUTTON_PORT |= _BV(BUTTON1_BIT) | _BV(BUTTON2_BIT);
+	i = PROFILE_BUCKETS;
+	while (--i && profileStart[i] > pc)
+		;
+	if (profileCount[i] != 0xffff)
+	{
+		profileCount[i]++;
+	}
+}
 
-	/* initialize LED output */
+static uchar profileSetup(usbRequest_t *rq)
+{
+	uchar i;
+
+	if (rq->bRequest == RQ_PROFILE_BUCKET)
+	{
+		i = rq->wIndex.bytes[0];
+		if (i < PROFILE_BUCKETS)
+		{
+			profileStart[i] = rq->wValue.word;
+		}
+		for (i = 0; i <= PROFILE_BUCKETS; i++)
+		{
+			profileCount[i] = 0;
+		}
+	}
+	else if (rq->bRequest == RQ_PROFILE_READ)
+	{
+		usbMsgPtr = (usbMsgPtr_t)profileCount;
+		return sizeof(profileCount);
+	}
+	return 0;
+}
+
+#endif /* USE_PROFILER */
+
+/* ------------------------------------------------------------------------- */
+/* ------------------------------- Scheduler ------------------------------- */
+/* ------------------------------------------------------------------------- */
+
+/* The main loop runs a few cooperative tasks in a fixed order of priority,
+ * see taskTable.  A task is due when its period is over or when another task
+ * triggers it, and then runs to completion.  If it has to wait for something
+ * outside (the host taking the last report), it calls taskWait() and is run
+ * again on every pass of the loop until it gets through.  A task that gets
+ * through more than its deadline after it became due counts as a miss in
+ * taskMisses.
+ *
+ * The 1 ms tick is counted in software from Timer1, TICK_COUNTS at a time:
+ * 0.993 ms at 16.5 MHz, 1.04 ms at 12.8 MHz.  There is no tick interrupt
+ * to delay the USB interrupt.  With USE_IDLE_SLEEP the main loop sleeps
+ * while no task is due, Timer1 compare B wakes it for the next one.
+ */
+#define TICK_COUNTS     ((uchar)(F_CPU / 1024 / 1000.0 + 0.5))
+
+#define EVERY_PASS      0           /* period: run on every pass of the main loop */
+#define ON_TRIGGER      0xffff      /* period: only run when triggered */
+
+enum
+{
+	TASK_USB,                       /* usbPoll() and the configuration state */
+	TASK_INPUT,                     /* sample the buttons */
+	TASK_DEBOUNCE,                  /* accept button changes */
+	TASK_REPORT,                    /* arm interrupt reports */
+	TASK_LED,
+	TASK_PERSIST,                   /* EEPROM writes */
+#if USE_KEY_LADDER
+	TASK_LADDER,                    /* start the ADC on the ladders */
+#endif
+#if USE_PEDAL_AXIS
+	TASK_PEDAL,                     /* filter the pedal and arm its reports */
+#endif
+#if USE_TAP_HOLD
+	TASK_TAP_HOLD,                  /* end of the tapping term */
+#endif
+#if USE_CHORDS
+	TASK_CHORD,                     /* end of the chord window */
+#endif
+#if USE_TURBO
+	TASK_TURBO,                     /* next half period of turbo and repeat */
+#endif
+#if USE_LATCH
+	TASK_LATCH,                     /* both buttons held to switch latching */
+#endif
+#if USE_HANG
+	TASK_HANG,                      /* end of a hang time */
+#endif
+#if USE_MULTI_TAP
+	TASK_MULTI_TAP,                 /* end of the window after a tap */
+#endif
+#if USE_PROFILES
+	TASK_KEYMAP,                    /* both buttons held to switch the profile */
+#endif
+	TASK_COUNT
+};
+
+#define TASK_IDLE       0
+#define TASK_DUE        1           /* runs once taskDue is reached */
+#define TASK_BLOCKED    2           /* due, but waits for something outside */
+
+static uint16_t tickNow;            /* ticks since reset */
+static uchar    tickTimer;          /* TCNT1 at the start of tickNow */
+static uchar    taskState[TASK_COUNT];
+static uint16_t taskDue[TASK_COUNT];
+
+/* read by the simulator, so this can't be static */
+uchar taskMisses[TASK_COUNT];
+
+/* catch up with Timer1, has to be called at least every 256 counts (~16 ms),
+ * calibrateOscillator() blocks longer and calls it between its measurements
+ */
+static void tickUpdate(void)
+{
+	while ((uchar)(TCNT1 - tickTimer) >= TICK_COUNTS)
+	{
+		tickTimer += TICK_COUNTS;
+		tickNow++;
+	}
+}
+
+/* make the task due now, unless it is already */
+static void taskTrigger(uchar task)
+{
+	if (taskState[task] == TASK_IDLE || (int16_t)(taskDue[task] - tickNow) > 0)
+	{
+		taskState[task] = TASK_DUE;
+		taskDue[task] = tickNow;
+	}
+}
+
+/* make the task due in the given number of ticks */
+static void taskDelay(uchar task, uint16_t ticks)
+{
+	taskState[task] = TASK_DUE;
+	taskDue[task] = tickNow + ticks;
+}
+
+/* called by a running task that can't get through yet */
+static void taskWait(uchar task)
+{
+	taskState[task] = TASK_BLOCKED;
+}
+
+/* ------------------------------------------------------------------------- */
+/* ------------------------------- Idle Sleep ------------------------------ */
+/* ------------------------------------------------------------------------- */
+
+#if USE_IDLE_SLEEP
+
+/* The main loop sleeps in idle mode when there is nothing to do.  Everything
+ * that can give it work wakes it up again:
+ *  - INT0, the USB interrupt: every packet on the bus
+ *  - pin change on D-: the 1 ms keep-alives and the end of a bus reset,
+ *    both of which usbPoll() has to see.  It is only enabled around the
+ *    sleep instruction, awake it would only add an interrupt after every
+ *    packet.  USE_LED_PWM keeps it on to notice a suspend.
+ *  - pin change on the buttons
+ *  - Timer1 overflow (~16 ms): keeps the watchdog fed and the tick counted
+ *    while the bus is suspended
+ *  - Timer1 compare B when the next task is due, and compare A for the
+ *    poll scheduler
+ * The empty interrupts only add a few cycles after the USB interrupt.
+ */
+#if !USE_LED_PWM
+EMPTY_INTERRUPT(PCINT0_vect);       /* USE_LED_PWM notes the bus activity */
+#endif
+EMPTY_INTERRUPT(TIM1_OVF_vect);
+EMPTY_INTERRUPT(TIM1_COMPB_vect);
+#if USE_POLL_SYNC
+EMPTY_INTERRUPT(TIM1_COMPA_vect);
+#endif
+
+static void sleepInit(void)
+{
+	/* switch off what we don't use */
+	ACSR = _BV(ACD);
+#if USE_KEY_LADDER
+	/* ladderTask() wakes us up for the readings instead of pin changes */
+	PRR = USE_PROFILER || USE_LED_PWM ? _BV(PRUSI) : _BV(PRUSI) | _BV(PRTIM0);
+#elif USE_PEDAL_AXIS || USE_RAPID_TRIGGER
+	PRR = USE_PROFILER || USE_LED_PWM ? _BV(PRUSI) : _BV(PRUSI) | _BV(PRTIM0);
+	PCMSK |= (_BV(BUTTON1_BIT) | _BV(BUTTON2_BIT)) & ~ANALOG_BITS;
+#else
+#if USE_PROFILER || USE_LED_PWM
+	PRR = _BV(PRUSI) | _BV(PRADC);
+#else
+	PRR = _BV(PRUSI) | _BV(PRADC) | _BV(PRTIM0);
+#endif
+	PCMSK |= _BV(BUTTON1_BIT) | _BV(BUTTON2_BIT);
+#endif
+	GIMSK |= _BV(PCIE);
+#if USE_POLL_SYNC
+	TIMSK |= _BV(TOIE1) | _BV(OCIE1A);
+#else
+	TIMSK |= _BV(TOIE1);
+#endif
+	set_sleep_mode(SLEEP_MODE_IDLE);
+}
+
+extern volatile schar usbRxLen;     /* usbdrv.h only has it with flow control */
+
+/* sleep unless the USB interrupt has left a packet for usbPoll(), at the
+ * most until the next task is due in the given number of ticks
+ */
+static void idleSleep(uint16_t ticks)
+{
+	if (ticks <= 255 / TICK_COUNTS)
+	{
+		OCR1B = tickTimer + (uchar)ticks * TICK_COUNTS;
+		TIFR = _BV(OCF1B);
+		TIMSK |= _BV(OCIE1B);
+	}
+	else
+	{
+		TIMSK &= ~_BV(OCIE1B); /* the overflow comes first */
+	}
+
+	cli();
+	if (usbRxLen == 0)
+	{
+#if !USE_LED_PWM
+		PCMSK |= _BV(USB_CFG_DMINUS_BIT);
+#endif
+		sleep_enable();
+		sei();
+		sleep_cpu(); /* sei delays pending interrupts until after this */
+		sleep_disable();
+#if !USE_LED_PWM
+		PCMSK &= ~_BV(USB_CFG_DMINUS_BIT);
+#endif
+	}
+	sei();
+}
+
+#endif /* USE_IDLE_SLEEP */
+
+/* ------------------------------------------------------------------------- */
+/* -------------------------------- LED PWM -------------------------------- */
+/* ------------------------------------------------------------------------- */
+
+#if USE_LED_PWM
+
+/* PB0 is OC0A: Timer0 runs fast PWM at F_CPU/8/256 (8 kHz at 16.5 MHz) and
+ * LED_ON/LED_OFF only connect the pin to it or let it sit high, so the LED
+ * is dimmed to LED_BRIGHTNESS without any interrupt.  The default quarter
+ * brightness saves 75% of the LED current.
+ *
+ * ledStatus() runs first in ledTask() and takes the LED over for
+ *  - a suspended bus: off, the host only grants 2.5 mA then
+ *  - a failed oscillator calibration: blinking at ~8 Hz
+ * To notice a suspend ledTask() runs every LED_CHECK_TICKS and looks
+ * whether a pin change on D- (the 1 ms keep-alives, packets) has set
+ * BUS_ACTIVE since the last time.  With USE_IDLE_SLEEP a button change
+ * counts too.
+ */
+#define LED_CHECK_TICKS 64
+#define BUS_ACTIVE      0           /* bit in GPIOR0 */
+
+static uchar ledFault;              /* calibrateOscillator() missed */
+static uchar ledSuspended;          /* no bus activity in the last check */
+static uchar ledBlink;              /* phase of the fault pattern */
+static uint16_t ledChecked;         /* tick of the last check */
+
+/* an sbi, the USB interrupt waits for 6 cycles at the most */
+ISR(PCINT0_vect, ISR_NAKED)
+{
+	GPIOR0 |= _BV(BUS_ACTIVE);
+	reti();
+}
+
+static void ledInit(void)
+{
+	LED_PORT |= _BV(LED_BIT);       /* off while the timer is not connected */
 	LED_DDR |= _BV(LED_BIT);
-	LED_ON;
+	OCR0A = LED_BRIGHTNESS - 1;     /* inverting: low up to the match */
+	TCCR0A = _BV(WGM01) | _BV(WGM00);
+	TCCR0B = _BV(CS01);
+	PCMSK |= _BV(USB_CFG_DMINUS_BIT);
+	GIMSK |= _BV(PCIE);
+}
 
-	/* select clock: 16.5M/1k -> overflow rate = 16.5M/256k = 62.94 Hz (~11ms) */
-	TCCR1 = 0x0b;
+/* returns 1 while a status owns the LED */
+static uchar ledStatus(void)
+{
+	if ((uint16_t)(tickNow - ledChecked) >= LED_CHECK_TICKS)
+	{
+		ledChecked = tickNow;
+		ledSuspended = !(GPIOR0 & _BV(BUS_ACTIVE));
+		GPIOR0 &= ~_BV(BUS_ACTIVE);
+		ledBlink ^= 1;
+	}
+	taskDelay(TASK_LED, LED_CHECK_TICKS - (uint16_t)(tickNow - ledChecked));
+	if (ledSuspended || (ledFault && !ledBlink))
+	{
+		LED_OFF;
+		return 1;
+	}
+	if (ledFault)
+	{
+		LED_ON;
+		return 1;
+	}
+	return 0;
+}
+
+#endif /* USE_LED_PWM */
+
+/* ------------------------------------------------------------------------- */
+/* ---------------------------- Resistor Ladder ---------------------------- */
+/* ------------------------------------------------------------------------- */
+
+#if USE_KEY_LADDER
+
+/* Each button pin reads a resistor ladder instead of a single button: an
+ * external pull-up R0 to VCC (the internal one is too inaccurate) and
+ * LADDER_KEYS keys, key j pulling the pin to GND through R0 * j / (N - j).
+ * With R0 = 10k and 6 keys that is 0 (a plain short), 2k, 5k, 10k, 20k and
+ * 50k; the levels are evenly spaced from GND to VCC, VCC meaning no key.
+ * Only one key per ladder counts, the one with the smallest resistor.
+ *
+ * ladderTask() starts the ADC once per tick.  At F_CPU/128 it converts both
+ * pins one after the other, 13 ADC clocks each (200 us for both at
+ * 16.5 MHz, 260 us at 12.8 MHz), and then stops until the next tick, so idle sleep is
+ * only broken twice per tick.  A key is taken once two readings in a row
+ * agree, so decoding adds 1 to 2 ms.  A reading has to come within
+ * LADDER_WINDOW of a level to change the key, and the key stays while the
+ * readings are within LADDER_WINDOW + 2 * LADDER_HYST of its level.
+ *
+ * The ADC interrupt lets the USB interrupt in right away (ISR_NOBLOCK), it
+ * only delays it by a few cycles.
+ */
+#define LADDER_STEP     (255.0 / LADDER_KEYS)                   /* ADC counts between levels */
+#define LADDER_HYST     ((uchar)(LADDER_STEP / 8))
+#define LADDER_WINDOW   ((uchar)(LADDER_STEP / 2) - LADDER_HYST)
+#define LADDER_MUX(pin) (_BV(ADLAR) | ((pin) ? 3 : 2))          /* ADC2 = PB4 = button 1, ADC3 = PB3 */
+
+/* written from the ADC interrupt, so these can't be static */
+volatile uchar ladderValue[2];      /* last reading of each ladder, 8 bits */
+volatile uchar ladderSeq[2];        /* incremented on every reading */
+
+static uchar ladderLevel[LADDER_KEYS + 1];  /* ADC reading of key j, LADDER_KEYS: no key */
+static uchar ladderSeen[2];
+static uchar ladderCandidate[2];    /* key of the last reading */
+static uchar ladderKey[2];          /* key taken, LADDER_KEYS: none */
+
+/* button 1 has been read: go on with button 2, after that the ADC stops */
+ISR(ADC_vect, ISR_NOBLOCK)
+{
+	uchar pin = ADMUX & 1;
+
+	ladderValue[pin] = ADCH;
+	ladderSeq[pin]++;
+	if (pin == 0)
+	{
+		ADMUX = LADDER_MUX(1);
+		ADCSRA |= _BV(ADSC);
+	}
+}
+
+static void ladderInit(void)
+{
+	uchar j;
+
+	for (j = 0; j <= LADDER_KEYS; j++)
+	{
+		ladderLevel[j] = (uchar)(j * LADDER_STEP + 0.5);
+	}
+	ladderKey[0] = ladderKey[1] = LADDER_KEYS;
+
+	/* the pull-ups are external, no digital input on the ladders */
+	BUTTON_PORT &= ~(_BV(BUTTON1_BIT) | _BV(BUTTON2_BIT));
+	DIDR0 = _BV(ADC2D) | _BV(ADC3D);
+
+	ADMUX = LADDER_MUX(0);
+	ADCSRA = _BV(ADEN) | _BV(ADIE) | _BV(ADPS2) | _BV(ADPS1) | _BV(ADPS0);
+}
+
+/* one reading of both ladders per tick */
+static void ladderTask(void)
+{
+	if (!(ADCSRA & _BV(ADSC)))
+	{
+		ADMUX = LADDER_MUX(0);
+		ADCSRA |= _BV(ADSC);
+	}
+}
+
+/* key for a reading, or the current one if the reading is between windows */
+static uchar ladderDecode(uchar value, uchar key)
+{
+	uchar j;
+
+	if (abs(value - ladderLevel[key]) <= LADDER_WINDOW + 2 * LADDER_HYST)
+	{
+		return key;
+	}
+	for (j = 0; j <= LADDER_KEYS; j++)
+	{
+		if (abs(value - ladderLevel[j]) <= LADDER_WINDOW)
+		{
+			return j;
+		}
+	}
+	return key;
+}
+
+/* keys of both ladders, bit j for key j of button 1, LADDER_KEYS + j for button 2 */
+static keys_t ladderKeys(void)
+{
+	keys_t keys = 0;
+	uchar pin, seq, value, key;
+
+	for (pin = 0; pin < 2; pin++)
+	{
+		cli();
+		seq = ladderSeq[pin];
+		value = ladderValue[pin];
+		sei();
+		if (seq != ladderSeen[pin])
+		{
+			ladderSeen[pin] = seq;
+			key = ladderDecode(value, ladderKey[pin]);
+			if (key == ladderCandidate[pin])
+			{
+				ladderKey[pin] = key;
+			}
+			ladderCandidate[pin] = key;
+		}
+		if (ladderKey[pin] != LADDER_KEYS)
+		{
+			keys |= (keys_t)1 << (ladderKey[pin] + pin * LADDER_KEYS);
+		}
+	}
+	return keys;
+}
+
+#endif /* USE_KEY_LADDER */
+
+/* ------------------------------------------------------------------------- */
+/* ------------------------------ Pedal Axis ------------------------------- */
+/* ------------------------------------------------------------------------- */
+
+#if USE_PEDAL_AXIS
+
+/* A potentiometer (wiper on the pin of button PEDAL_BUTTON, the ends on
+ * VCC and GND) is reported as a slider in a second collection, the other
+ * button stays a button.  The ADC runs free at F_CPU/128 on that pin and
+ * sums PEDAL_OVERSAMPLE readings: a 14 bit value every 1.6 ms at 16.5 MHz.
+ * pedalTask() low-pass filters that and only sends a report when the 8 bit
+ * result has moved by PEDAL_DEADBAND or reached an end, so a pedal that
+ * rests or jitters does not take the interrupt slots of the keyboard.
+ *
+ * The ADC interrupt lets the USB interrupt in right away (ISR_NOBLOCK).
+ */
+#define PEDAL_OVERSAMPLE    16
+#define PEDAL_DEADBAND      2       /* 8 bit counts */
+
+/* written from the ADC interrupt, so these can't be static */
+volatile uint16_t pedalSum;         /* PEDAL_OVERSAMPLE readings of 10 bits */
+volatile uchar    pedalSeq;         /* incremented with every new pedalSum */
+
+static uchar    pedalSeen;
+static uint16_t pedalFiltered;      /* 14 bits like pedalSum */
+
+ISR(ADC_vect, ISR_NOBLOCK)
+{
+	static uint16_t sum;
+	static uchar count;
+
+	sum += ADC;
+	if (++count == PEDAL_OVERSAMPLE)
+	{
+		pedalSum = sum;
+		pedalSeq++;
+		sum = 0;
+		count = 0;
+	}
+}
+
+static void pedalInit(void)
+{
+	DIDR0 = PEDAL_MUX == 2 ? _BV(ADC2D) : _BV(ADC3D);
+	ADMUX = PEDAL_MUX;
+	ADCSRB = 0; /* free running */
+	ADCSRA = _BV(ADEN) | _BV(ADSC) | _BV(ADATE) | _BV(ADIE) | _BV(ADPS2) | _BV(ADPS1) | _BV(ADPS0);
+}
+
+/* filtered pedal position, 8 bits */
+static uchar pedalPosition(void)
+{
+	uint16_t sum;
+	uchar seq;
+
+	cli();
+	sum = pedalSum;
+	seq = pedalSeq;
+	sei();
+	if (seq != pedalSeen)
+	{
+		/* first order low pass, a quarter of the way per new sum */
+		pedalSeen = seq;
+		pedalFiltered += (int16_t)(sum - pedalFiltered) >> 2;
+	}
+	return pedalFiltered >> 6;
+}
+
+#endif /* USE_PEDAL_AXIS */
+
+/* ------------------------------------------------------------------------- */
+/* ----------------------------- Rapid Trigger ----------------------------- */
+/* ------------------------------------------------------------------------- */
+
+#if USE_RAPID_TRIGGER
+
+/* Button 1 is a Hall effect switch: its sensor drives PB4 with a voltage
+ * that follows the travel of the key.  Instead of a fixed switch point the
+ * key is pressed once it has gone down rapidPress counts from the highest
+ * point since the last release, and released once it has come up
+ * rapidRelease counts from the lowest point since the press, anywhere
+ * below the actuation point.  Above the actuation point it is always
+ * released.  So a key can be pressed again right after letting it up a
+ * little, without going back past a fixed point.
+ *
+ * The settings are read from EEPROM at reset, erased bytes (0xff) give the
+ * defaults:
+ *   EEPROM_RAPID + 0   actuation point, 8 bit ADC counts
+ *   EEPROM_RAPID + 1   press distance
+ *   EEPROM_RAPID + 2   release distance
+ *   EEPROM_RAPID + 3   0: the voltage falls when the key goes down,
+ *                      else it rises
+ *
+ * The ADC runs free at F_CPU/64 with 8 bits, which is fast enough for
+ * those: one conversion takes 50 us at 16.5 MHz (65 us at 12.8 MHz).  The
+ * decision is made in the ADC interrupt for every conversion, inputTask()
+ * only picks up rapidDown, so it adds nothing to the conversion itself.
+ * The Hall sensor does not bounce, KEY1 skips the debouncing.
+ */
+#define RAPID_ACTUATION     128     /* defaults, half of VCC */
+#define RAPID_PRESS         8
+#define RAPID_RELEASE       8
+
+/* written from the ADC interrupt, so these can't be static */
+volatile uchar rapidDown;           /* KEY1 when pressed */
+
+static uchar rapidActuation, rapidPress, rapidRelease;
+static uchar rapidInvert;           /* 0xff if the voltage falls on pressing */
+
+ISR(ADC_vect, ISR_NOBLOCK)
+{
+	static uchar extreme;           /* highest point while released, lowest while pressed */
+	uchar travel = ADCH ^ rapidInvert;
+
+	if (travel < rapidActuation)
+	{
+		rapidDown = 0;
+		extreme = 0; /* reaching the actuation point presses */
+	}
+	else if (rapidDown)
+	{
+		if (travel > extreme)
+		{
+			extreme = travel;
+		}
+		else if (extreme - travel >= rapidRelease)
+		{
+			rapidDown = 0;
+			extreme = travel;
+		}
+	}
+	else
+	{
+		if (travel < extreme)
+		{
+			extreme = travel;
+		}
+		else if (travel - extreme >= rapidPress)
+		{
+			rapidDown = KEY1;
+			extreme = travel;
+		}
+	}
+}
+
+static uchar rapidSetting(uchar i, uchar value)
+{
+	uchar stored = eeprom_read_byte(EEPROM_RAPID + i);
+
+	return stored == 0xff ? value : stored;
+}
+
+static void rapidInit(void)
+{
+	rapidActuation = rapidSetting(0, RAPID_ACTUATION);
+	rapidPress = rapidSetting(1, RAPID_PRESS);
+	rapidRelease = rapidSetting(2, RAPID_RELEASE);
+	rapidInvert = rapidSetting(3, 1) ? 0 : 0xff;
+
+	DIDR0 = _BV(ADC2D);
+	ADMUX = _BV(ADLAR) | 2; /* ADC2 = PB4 */
+	ADCSRB = 0; /* free running */
+	ADCSRA = _BV(ADEN) | _BV(ADSC) | _BV(ADATE) | _BV(ADIE) | _BV(ADPS2) | _BV(ADPS1);
+}
+
+#endif /* USE_RAPID_TRIGGER */
+
+/* ------------------------------------------------------------------------- */
+/* --------------------------------- Latch --------------------------------- */
+/* ------------------------------------------------------------------------- */
+
+#if USE_LATCH
+
+/* A latching key stays down after its press and goes up with the next
+ * press, its releases don't count: push-to-talk without holding the
+ * pedal.  The toggle is taken on the debounced press edge, in the same
+ * pass as a plain key.  The LED is on while a key is latched.
+ *
+ * The settings live in EEPROM, an erased byte gives the defaults:
+ *   EEPROM_LATCH + 0   bits 0 and 1: the latching keys (button 1 and 2),
+ *                      bits 4 and 5: what keeps a latched key down
+ *                      LATCH_CLEAR: nothing, a bus reset lets it go
+ *                      LATCH_RAM: bus resets and watchdog or external
+ *                      resets of the chip (.noinit RAM)
+ *                      LATCH_EEPROM: power cycles too
+ *   EEPROM_LATCH + 1   the latched keys for LATCH_EEPROM
+ * Holding both buttons for LATCH_SWITCH_TICKS switches latching of
+ * button 1 on or off and stores that, no programmer needed.
+ */
+#define LATCH_CLEAR         0x00
+#define LATCH_RAM           0x10
+#define LATCH_EEPROM        0x20
+#define LATCH_KEEP          0x30    /* mask of the above */
+#define LATCH_DEFAULT       (KEY1 | LATCH_CLEAR)
+#define LATCH_SWITCH_TICKS  3000
+
+static uchar  latchConfig;          /* EEPROM_LATCH + 0 */
+static keys_t latchState;           /* keys latched down */
+static keys_t latchLast;            /* keyState at the last update */
+static uchar  latchDirty;           /* latchConfig or latchState have to go to EEPROM */
+
+/* survive a reset of the chip, but not the power: garbage after power-on */
+static keys_t latchKept __attribute__((section(".noinit")));
+static keys_t latchCheck __attribute__((section(".noinit")));
+
+static void latchInit(uchar resetCause)
+{
+	latchConfig = eeprom_read_byte(EEPROM_LATCH);
+	if (latchConfig == 0xff)
+	{
+		latchConfig = LATCH_DEFAULT;
+	}
+	if ((latchConfig & LATCH_KEEP) == LATCH_EEPROM && (resetCause & (_BV(PORF) | _BV(BORF))))
+	{
+		latchState = eeprom_read_byte(EEPROM_LATCH + 1) & latchConfig & (KEY1 | KEY2);
+	}
+	else if ((latchConfig & LATCH_KEEP) != LATCH_CLEAR && latchCheck == (keys_t)~latchKept && !(resetCause & (_BV(PORF) | _BV(BORF))))
+	{
+		latchState = latchKept & latchConfig & (KEY1 | KEY2);
+	}
+}
+
+static void latchChanged(void)
+{
+	latchKept = latchState;
+	latchCheck = ~latchState;
+	if ((latchConfig & LATCH_KEEP) == LATCH_EEPROM)
+	{
+		latchDirty = 1;
+	}
+}
+
+/* on every change of keyState */
+static void latchUpdate(keys_t keys)
+{
+	keys_t pressed = keys & ~latchLast & latchConfig;
+
+	latchLast = keys;
+	if (pressed)
+	{
+		latchState ^= pressed;
+		latchChanged();
+	}
+}
+
+/* the host has forgotten our keys */
+static void latchBusReset(void)
+{
+	if ((latchConfig & LATCH_KEEP) == LATCH_CLEAR && latchState)
+	{
+		latchState = 0;
+		latchChanged();
+	}
+}
+
+/* both buttons held long enough: switch latching of button 1 */
+static void latchSwitch(void)
+{
+	latchConfig ^= KEY1;
+	latchState &= latchConfig;
+	latchChanged();
+	latchDirty = 1;
+}
+
+#endif /* USE_LATCH */
+
+/* ------------------------------------------------------------------------- */
+
+static keys_t keyRaw;               /* buttons as last sampled */
+static keys_t keyState;             /* debounced buttons */
+static uint16_t keyChanged;         /* tick of the last change of keyState */
+static keys_t keyOnce;              /* usages for the next report even if they are up again */
+static keys_t earlyKeys;            /* keys pressed while not configured, see reportRestart() */
+#if USE_PROFILES
+static keys_t keymapMute;           /* held over a profile switch, silent until released */
+static keys_t keymapHeld;           /* held back, maybe the start of a switch */
+#endif
+
+/* The following function returns an index for the first key pressed. It
+ * returns 0 if no key is pressed.
+ *
+ * TODO: make both keys work independently from each other (don't let button 1
+ *       'overshadow' button 2)
+ */
+static PROFILED keys_t keyPressed(void)
+{
+#if USE_KEY_LADDER
+	return ladderKeys();
+#else
+	keys_t keystate = 0;
+
+	/* 
+	 * look out (I _always_ stumble over this):
+	 * as the buttons short to GND on closing, the pin value is reversed:
+	 * button bit = 0 -> button is pressed
+	 * button bit = 1 -> button is not pressed (pull-up active)
+	 */
+	if (GET_BIT(BUTTON_PIN, BUTTON1_BIT) == 0)
+	{
+		keystate |= KEY1;
+	}
+	if (GET_BIT(BUTTON_PIN, BUTTON2_BIT) == 0)
+	{
+		keystate |= KEY2;
+	}
+#if USE_PEDAL_AXIS
+	keystate &= PEDAL_BUTTON == 1 ? ~KEY1 : ~KEY2; /* no button on the pedal pin */
+#elif USE_RAPID_TRIGGER
+	keystate = (keystate & ~KEY1) | rapidDown;
+#endif
+
+	return keystate;
+#endif
+}
+
+/* ------------------------------------------------------------------------- */
+
+
+#if F_CPU == 12800000
+static uchar factoryCalibration;    /* OSCCAL for 8 MHz, see usbEventResetReady() */
+#endif
+#if RC_OSCILLATOR
+static uchar oscillatorCalibrated;  /* OSCCAL from EEPROM is still good, skip the next calibration */
+#endif
+
+/* How long to pull D- low so that the host notices we were gone, by reset
+ * cause.  After power-on the host has just seen us arrive and does not need
+ * this.  Hubs detect a disconnect after 2.5 us, so a few ms would do for the
+ * warm resets; we allow for sloppy hubs.  Without a known cause (a jump to 0)
+ * we do it like before.
+ */
+#define DISCONNECT_MS_POWER_ON  0
+#define DISCONNECT_MS_WARM      25
+#define DISCONNECT_MS_UNKNOWN   255
+
+static void hardwareInit(void)
+{
+	uchar i;
+	uchar resetCause = MCUSR;
+#if RC_OSCILLATOR
+	uchar calibrationValue;
+#endif
+
+	MCUSR = 0; /* WDRF would keep the watchdog enabled */
+
+#if F_CPU == 12800000
+	factoryCalibration = OSCCAL;
+#endif
+#if RC_OSCILLATOR
+	calibrationValue = eeprom_read_byte(EEPROM_OSCCAL); /* calibration value from last time */
+	if (calibrationValue != 0xff)
+	{
+		OSCCAL = calibrationValue;
+		/* neither temperature nor supply changed much on a warm reset */
+		oscillatorCalibrated = (resetCause & (_BV(WDRF) | _BV(EXTRF))) && !(resetCause & (_BV(PORF) | _BV(BORF)));
+	}
+#endif
+
+	/* the buttons first, they are sampled during the disconnect */
+#if USE_KEY_LADDER
+	ladderInit();
+#elif USE_PEDAL_AXIS || USE_RAPID_TRIGGER
+	/* activate the pull-up for the button, the other pin is driven */
+	BUTTON_PORT |= (_BV(BUTTON1_BIT) | _BV(BUTTON2_BIT)) & ~ANALOG_BITS;
+#if USE_PEDAL_AXIS
+	pedalInit();
+#else
+	rapidInit();
+#endif
+#else
+	/* activate pull-ups for the buttons */
+	BUTTON_PORT |= _BV(BUTTON1_BIT) | _BV(BUTTON2_BIT);
+#endif
+
+	if (resetCause & _BV(PORF))
+	{
+		i = DISCONNECT_MS_POWER_ON;
+	}
+	else if (resetCause != 0)
+	{
+		i = DISCONNECT_MS_WARM;
+	}
+	else
+	{
+		i = DISCONNECT_MS_UNKNOWN;
+	}
+
+	usbInit();
+	if (i != 0)
+	{
+		usbDeviceDisconnect();  /* enforce re-enumeration, do this while interrupts are disabled! */
+		while (i--)             /* fake USB disconnect */
+		{
+			wdt_reset();
+			_delay_ms(1);
+			/* a key tapped meanwhile still makes it into the first report;
+			 * the ladders and the rapid trigger key need the ADC interrupt
+			 * and only count from the main loop on
+			 */
+			earlyKeys |= keyPressed();
+		}
+		usbDeviceConnect();
+	}
+
+	wdt_enable(WDTO_1S);
+
+#if USE_LATCH
+	latchInit(resetCause);
+#endif
+
+	/* initialize LED output */
+#if USE_LED_PWM
+	ledInit();
+#else
+	LED_DDR |= _BV(LED_BIT);
+#endif
+	LED_ON;
+
+	/* select clock: F_CPU/1k -> overflow rate = 16.5M/256k = 62.94 Hz (~16ms),
+	 * 12.8M/256k = 48.83 Hz (~20ms) */
+	TCCR1 = 0x0b;
+
+#if USE_PROFILER
+	profileInit();
+#endif
+#if USE_IDLE_SLEEP
+	sleepInit();
+#endif
+}
+
+/* ------------------------------------------------------------------------- */
+/* -------------------------------- Tap-Hold ------------------------------- */
+/* ------------------------------------------------------------------------- */
+
+#if USE_TAP_HOLD
+
+/* Both keys do double duty: released within TAPPING_TERM they send their
+ * tap usage (KEY1, KEY2 in buildReport()) once, held longer their hold
+ * usage (KEY1_HOLD, KEY2_HOLD) for as long as they are down.  Before the
+ * term is up a key is undecided, and TAP_HOLD_POLICY may decide it early
+ * when the other key is used meanwhile.
+ *
+ * A hold usage in TAP_HOLD_SPECULATIVE is reported right on the press,
+ * before the decision: a tap takes it back in the report that carries the
+ * tap, so holds cost no time at all.  Only use this for modifiers that do
+ * nothing on their own, like Shift and Ctrl.  A speculative hold that the
+ * host has already seen together with a tap of the other key stays a
+ * hold.  Otherwise a hold shows up when the term is up (or the policy
+ * decides), and a tap on its release.
+ *
+ * tapHoldUpdate() runs on every change of keyState and, through
+ * TASK_TAP_HOLD, when the term of an undecided key is up.
+ */
+static keys_t   tapLast;            /* keyState at the last update */
+static keys_t   tapUndecided;       /* down, tap or hold not known yet */
+static keys_t   tapHolding;         /* down and decided as hold */
+static keys_t   tapKeys;            /* usages down */
+static uint16_t tapStart[NUM_KEYS]; /* tick of the press */
+
+static void tapHoldUpdate(void)
+{
+	keys_t pressed = keyState & ~tapLast;
+	keys_t released = tapLast & ~keyState;
+	keys_t hold = 0, tap;
+	uint16_t left, next = 0xffff;
+	uchar i;
+
+	tapLast = keyState;
+
+	/* the term first, in case this runs late */
+	for (i = 0; i < NUM_KEYS; i++)
+	{
+		if (tapUndecided & (1 << i))
+		{
+			left = TAPPING_TERM - (tickNow - tapStart[i]);
+			if ((int16_t)left <= 0)
+			{
+				hold |= 1 << i;
+			}
+		}
+	}
+	tapUndecided &= ~hold;
+
+	tap = released & tapUndecided;
+	tapUndecided &= ~released;
+	tapHolding &= ~released;
+
+#if TAP_HOLD_POLICY == TAP_HOLD_PERMISSIVE
+	if (tap)
+	{
+		hold |= tapUndecided;
+	}
+#elif TAP_HOLD_POLICY == TAP_HOLD_ON_OTHER
+	if (pressed)
+	{
+		hold |= tapUndecided;
+	}
+#endif
+	if (tap)
+	{
+		hold |= tapUndecided & TAP_HOLD_SPECULATIVE;
+	}
+	tapUndecided &= ~hold;
+	tapHolding |= hold;
+	keyOnce |= tap;
+
+	tapUndecided |= pressed;
+	for (i = 0; i < NUM_KEYS; i++)
+	{
+		if (pressed & (1 << i))
+		{
+			tapStart[i] = tickNow;
+		}
+		if (tapUndecided & (1 << i))
+		{
+			left = TAPPING_TERM - (tickNow - tapStart[i]);
+			if (left < next)
+			{
+				next = left;
+			}
+		}
+	}
+	if (next != 0xffff)
+	{
+		taskDelay(TASK_TAP_HOLD, next);
+	}
+
+	tapKeys = (tapHolding | (tapUndecided & TAP_HOLD_SPECULATIVE)) << 2;
+}
+
+#endif /* USE_TAP_HOLD */
+
+/* ------------------------------------------------------------------------- */
+/* --------------------------------- Chords -------------------------------- */
+/* ------------------------------------------------------------------------- */
+
+#if USE_CHORDS
+
+/* Both buttons pressed within CHORD_WINDOW of each other send KEY_CHORD
+ * instead of KEY1 and KEY2, until both are up again.  To find out, a
+ * single press is held back for CHORD_WINDOW; that is the only delay a
+ * single button gets, and a button released within it is sent as a tap.
+ * The window has to be longer than DEBOUNCE_TICKS, as the debouncing
+ * holds back the second button for that long.
+ *
+ * If the other button comes later, but within CHORD_RETRACT of the first,
+ * the first one has been reported already: the next report takes it back
+ * and shows the chord instead.  With the default bindings the host then
+ * sees push-to-talk end right away, not the start of a conversation.
+ *
+ * chordUpdate() runs on every change of keyState and, through TASK_CHORD,
+ * at the end of the window.
+ */
+static keys_t   chordLast;          /* keyState at the last update */
+static keys_t   chordKeys;          /* usages down */
+static uchar    chordOn;            /* the chord is down */
+static uchar    chordWaiting;       /* a single press is held back */
+static uint16_t chordStart;         /* tick of the first press */
+
+static void chordUpdate(void)
+{
+	keys_t pressed = keyState & ~chordLast;
+	keys_t released = chordLast & ~keyState;
+	uint16_t since;
+
+	chordLast = keyState;
+	if (pressed == keyState && pressed != 0)
+	{
+		chordStart = tickNow; /* the first press after all were up */
+	}
+	since = tickNow - chordStart;
+
+	if (chordWaiting)
+	{
+		keyOnce |= released; /* a tap within the window */
+	}
+	if (!chordOn && keyState == (KEY1 | KEY2) && pressed != 0 && since < CHORD_RETRACT)
+	{
+		chordOn = 1;
+	}
+	else if (chordOn && keyState == 0)
+	{
+		chordOn = 0;
+	}
+
+	chordWaiting = !chordOn && keyState != 0 && since < CHORD_WINDOW;
+	if (chordWaiting)
+	{
+		taskDelay(TASK_CHORD, CHORD_WINDOW - since);
+	}
+
+	if (chordOn)
+	{
+		chordKeys = KEY_CHORD;
+	}
+	else if (chordWaiting)
+	{
+		chordKeys = 0;
+	}
+	else
+	{
+		chordKeys = keyState;
+	}
+}
+
+#endif /* USE_CHORDS */
+
+/* ------------------------------------------------------------------------- */
+/* ------------------------------- Hang Time ------------------------------- */
+/* ------------------------------------------------------------------------- */
+
+#if USE_HANG
+
+/* A push-to-talk pedal let go too early cuts off the last syllable: the
+ * release of button 1 (2) is reported HANG_TIME1 (2) ms late, the press
+ * still at once.  Pressed again within that time, the key simply stays
+ * down for the host, without any report in between.  The pending
+ * releases are deadlines of TASK_HANG, the main loop goes on meanwhile.
+ */
+static const PROGMEM uint16_t hangTime[2] = { HANG_TIME1, HANG_TIME2 };
+
+static keys_t   hangLast;           /* keyState at the last update */
+static keys_t   hangKeys;           /* released, but still reported down */
+static uint16_t hangUntil[2];       /* tick of the report of the release */
+
+/* the next hang time to end, in TASK_HANG */
+static void hangSchedule(void)
+{
+	uint16_t left, next = 0xffff;
+	uchar i;
+
+	for (i = 0; i < 2; i++)
+	{
+		if (hangKeys & (1 << i))
+		{
+			left = hangUntil[i] - tickNow;
+			if ((int16_t)left < 0)
+			{
+				left = 0;
+			}
+			if (left < next)
+			{
+				next = left;
+			}
+		}
+	}
+	if (next != 0xffff)
+	{
+		taskDelay(TASK_HANG, next);
+	}
+}
+
+/* on every change of keyState */
+static void hangUpdate(void)
+{
+	keys_t released = hangLast & ~keyState;
+	uchar i;
+
+	hangLast = keyState;
+	hangKeys &= ~keyState; /* pressed again within the hang time */
+	for (i = 0; i < 2; i++)
+	{
+		if ((released & (1 << i)) && pgm_read_word(&hangTime[i]) != 0)
+		{
+			hangKeys |= 1 << i;
+			hangUntil[i] = tickNow + pgm_read_word(&hangTime[i]);
+		}
+	}
+	hangSchedule();
 }
 
-/* USB IDLE is counted in 4ms - how many are there in one timer overflow (~11ms)? */
-#define OVERFLOWS_4MS 3
-/* TODO: this is slightly too much, would 2 be better? */
+#endif /* USE_HANG */
 
+/* ------------------------------------------------------------------------- */
+/* ------------------------------- Multi-Tap ------------------------------- */
 /* ------------------------------------------------------------------------- */
 
-#define NUM_KEYS 2
+#if USE_MULTI_TAP
 
-/* The following function returns an index for the first key pressed. It
- * returns 0 if no key is pressed.
+/* Taps of button 2 that follow each other within MULTI_TAP_WINDOW of the
+ * last release make a series, which sends KEY2_TAP1, KEY2_TAP2 or
+ * KEY2_TAP3 as a tap: pressed in one report, released in the next.  A
+ * series ends with its third tap.  Button 1 stays a plain key.
  *
- * TODO: make both keys work independently from each other (don't let button 1
- *       'overshadow' button 2)
+ * Normally a series is sent when the window after its last tap is over,
+ * so single and double taps arrive MULTI_TAP_WINDOW late.  With
+ * MULTI_TAP_IMMEDIATE every press is sent at once: the first as
+ * KEY2_TAP1, the next ones as KEY2_UNDO followed by the upgraded tap in
+ * the report after it (so with the default bindings "1" becomes "2").
  */
-static uchar keyPressed(void)
+#define MULTI_TAP_MAX   3
+
+static keys_t   multiLast;          /* keyState at the last update */
+static uchar    multiCount;         /* taps in the series so far */
+static keys_t   multiNext;          /* the upgrade, after its undo */
+
+/* on every change of keyState */
+static void multiTapUpdate(void)
 {
-	uchar keystate = 0;
+	keys_t pressed = keyState & ~multiLast & KEY2;
+	keys_t released = multiLast & ~keyState & KEY2;
 
-	/* 
-	 * look out (I _always_ stumble over this):
-	 * as the buttons short to GND on closing, the pin value is reversed:
-	 * button bit = 0 -> button is pressed
-	 * button bit = 1 -> button is not pressed (pull-up active)
-	 */
-	if (GET_BIT(BUTTON_PIN, BUTTON1_BIT) == 0)
+	multiLast = keyState;
+	if (pressed)
 	{
-		keystate |= KEY1;
+		multiCount++;
+#if MULTI_TAP_IMMEDIATE
+		if (multiCount == 1)
+		{
+			keyOnce |= KEY2_TAP1;
+		}
+		else
+		{
+			keyOnce |= KEY2_UNDO;
+			multiNext = KEY2_TAP1 << (multiCount - 1);
+		}
+#else
+		if (multiCount == MULTI_TAP_MAX)
+		{
+			keyOnce |= KEY2_TAP1 << (MULTI_TAP_MAX - 1);
+		}
+#endif
+		if (multiCount == MULTI_TAP_MAX)
+		{
+			multiCount = 0; /* nothing more to wait for */
+		}
 	}
-	if (GET_BIT(BUTTON_PIN, BUTTON2_BIT) == 0)
+	if (released && multiCount != 0)
 	{
-		keystate |= KEY2;
+		taskDelay(TASK_MULTI_TAP, MULTI_TAP_WINDOW);
 	}
+}
 
+#endif /* USE_MULTI_TAP */
 
+/* usages down, before turbo */
+static keys_t keyUsages(void)
+{
+#if USE_TAP_HOLD
+	return tapKeys | keyOnce;
+#elif USE_CHORDS
+	return chordKeys | keyOnce;
+#elif USE_LATCH
+	return (keyState & ~latchConfig) | latchState;
+#elif USE_HANG
+	return keyState | hangKeys;
+#elif USE_MULTI_TAP
+	return (keyState & ~KEY2) | keyOnce;
+#elif USE_PROFILES
+	return keyState | keyOnce;
+#else
+	return keyState;
+#endif
+}
 
-	/*********************************************/
-	/* EDIT BELOW FOR YOUR OWN LED CONFIGURATION */
+/* ------------------------------------------------------------------------- */
+/* ------------------------------ Turbo/Repeat ----------------------------- */
+/* ------------------------------------------------------------------------- */
 
-	if (keystate == 0)
+#if USE_TURBO
+
+/* While a key of TURBO_KEYS is held, the reports show it pressed and
+ * released in turn, TURBO_RATE times a second.  A key of REPEAT_KEYS is
+ * sent pressed at once and starts doing the same after REPEAT_DELAY.  The
+ * bits are those of buildReport(), all keys held share one phase.
+ *
+ * Every half period has to reach the host on its own, or the host sees
+ * nothing of it: turboTask() only flips the phase once the report of the
+ * last one has been armed (turboSent) and taken (usbInterruptIsReady()),
+ * and the next half period is counted from there.  So a host that polls
+ * late makes the rate drop rather than a press go missing.  The fastest
+ * rate is one half period per poll.
+ */
+#define TURBO_HALF      (500 / TURBO_RATE)  /* ms */
+
+/* with USE_EEPROM_INTERVAL configInit() keeps the interval at TURBO_HALF */
+#if TURBO_HALF < USB_CFG_INTR_POLL_INTERVAL
+#error "TURBO_RATE is faster than one half period per poll"
+#endif
+
+static keys_t turboHeld;            /* turbo and repeat usages down */
+static keys_t turboOff;             /* held, but in the released half */
+static uchar  turboSent;            /* the current half has been armed */
+
+/* before a report is armed: new presses start with the pressed half */
+static void turboUpdate(void)
+{
+	keys_t held = keyUsages() & (TURBO_KEYS | REPEAT_KEYS);
+	keys_t pressed = held & ~turboHeld;
+
+	turboHeld = held;
+	turboOff &= held;
+	if (pressed)
 	{
-		LED_OFF;
+		turboOff = 0;
+		taskDelay(TASK_TURBO, (pressed & REPEAT_KEYS) ? REPEAT_DELAY : TURBO_HALF);
 	}
-	else
+	turboSent = 1;
+}
+
+static void turboTask(void)
+{
+	if (turboHeld == 0)
 	{
-		LED_ON;
+		return;
 	}
+	if (!turboSent || !usbInterruptIsReady())
+	{
+		taskWait(TASK_TURBO); /* the host has not got the last half yet */
+		return;
+	}
+	turboOff = turboOff ? 0 : turboHeld;
+	turboSent = 0;
+	taskTrigger(TASK_REPORT);
+	taskDelay(TASK_TURBO, TURBO_HALF);
+}
 
-	/* EDIT ABOVE FOR YOUR OWN LED CONFIGURATION */
-	/*********************************************/
-
+#endif /* USE_TURBO */
 
+/* keys for the reports */
+static keys_t keyOutput(void)
+{
+	keys_t keys = keyUsages();
 
-	return keystate;
+#if USE_TURBO
+	keys &= ~turboOff;
+#endif
+#if USE_PROFILES
+	keys &= ~(keymapMute | keymapHeld);
+#endif
+	return keys;
 }
 
 /* ------------------------------------------------------------------------- */
 /* ----------------------------- USB interface ----------------------------- */
 /* ------------------------------------------------------------------------- */
 
+#if USE_PEDAL_AXIS
+/* two collections need report IDs in front of the reports */
+#define REPORT_ID_KEYBOARD  1
+#define REPORT_ID_PEDAL     2
+static uchar reportBuffer[4];    /* report ID, then the keyboard report */
+#define keyboardReport (reportBuffer + 1)
+static uchar pedalReport[2] = { REPORT_ID_PEDAL, 0 };
+#elif USE_GAMEPAD
+static uchar reportBuffer[1];    /* buttons 1 to 8 */
+#else
 static uchar reportBuffer[3];    /* buffer for HID reports */
+#define keyboardReport reportBuffer
+#endif
 static uchar idleRate;           /* in 4 ms units */
 
 #define KEYS_IN_REPORT 2   /* modifier does not count, only slots for real keys (the REPORT_COUNT of the second INPUT below) */
 
-const PROGMEM char usbHidReportDescriptor[35] = {   /* USB report descriptor */
+#if USE_GAMEPAD
+
+const PROGMEM char usbHidReportDescriptor[USB_CFG_HID_REPORT_DESCRIPTOR_LENGTH] = {   /* USB report descriptor */
+	0x05, 0x01,                    // USAGE_PAGE (Generic Desktop)
+	0x09, 0x05,                    // USAGE (Game Pad)
+	0xa1, 0x01,                    // COLLECTION (Application)
+	0x05, 0x09,                    //   USAGE_PAGE (Button)
+	0x19, 0x01,                    //   USAGE_MINIMUM (Button 1)
+	0x29, 0x08,                    //   USAGE_MAXIMUM (Button 8)
+	0x15, 0x00,                    //   LOGICAL_MINIMUM (0)
+	0x25, 0x01,                    //   LOGICAL_MAXIMUM (1)
+	0x75, 0x01,                    //   REPORT_SIZE (1)
+	0x95, 0x08,                    //   REPORT_COUNT (8)
+	0x81, 0x02,                    //   INPUT (Data,Var,Abs)
+	0xc0,                          // END_COLLECTION
+};
+/* Games read the buttons directly, without the keyboard layout and key
+ * repeat of the operating system in between.  The report is a single
+ * byte: button n is usage bit n - 1 (KEY1, KEY2, and the extra usages of
+ * tap-hold, chords and so on), so there is nothing to configure.
+ */
+
+#else /* USE_GAMEPAD */
+
+const PROGMEM char usbHidReportDescriptor[USB_CFG_HID_REPORT_DESCRIPTOR_LENGTH] = {   /* USB report descriptor */
 	0x05, 0x01,                    // USAGE_PAGE (Generic Desktop)
 	0x09, 0x06,                    // USAGE (Keyboard)
 	0xa1, 0x01,                    // COLLECTION (Application)
+#if USE_PEDAL_AXIS
+	0x85, REPORT_ID_KEYBOARD,      //   REPORT_ID (1)
+#endif
 	0x05, 0x07,                    //   USAGE_PAGE (Keyboard)
 	0x19, 0xe0,                    //   USAGE_MINIMUM (Keyboard LeftControl)
 	0x29, 0xe7,                    //   USAGE_MAXIMUM (Keyboard Right GUI)
@@ -171,7 +1798,20 @@ const PROGMEM char usbHidReportDescriptor[35] = {   /* USB report descriptor */
 	0x19, 0x00,                    //   USAGE_MINIMUM (Reserved (no event indicated))
 	0x29, 0x65,                    //   USAGE_MAXIMUM (Keyboard Application)
 	0x81, 0x00,                    //   INPUT (Data,Ary,Abs)
-	0xc0                           // END_COLLECTION
+	0xc0,                          // END_COLLECTION
+#if USE_PEDAL_AXIS
+	0x05, 0x01,                    // USAGE_PAGE (Generic Desktop)
+	0x09, 0x04,                    // USAGE (Joystick)
+	0xa1, 0x01,                    // COLLECTION (Application)
+	0x85, REPORT_ID_PEDAL,         //   REPORT_ID (2)
+	0x09, 0x36,                    //   USAGE (Slider)
+	0x15, 0x00,                    //   LOGICAL_MINIMUM (0)
+	0x26, 0xff, 0x00,              //   LOGICAL_MAXIMUM (255)
+	0x75, 0x08,                    //   REPORT_SIZE (8)
+	0x95, 0x01,                    //   REPORT_COUNT (1)
+	0x81, 0x02,                    //   INPUT (Data,Var,Abs)
+	0xc0,                          // END_COLLECTION
+#endif
 };
 /* We use a simplifed keyboard report descriptor which does not support the
  * boot protocol. We don't allow setting status LEDs and we only allow one
@@ -183,6 +1823,95 @@ const PROGMEM char usbHidReportDescriptor[35] = {   /* USB report descriptor */
  * for the second INPUT item.
  */
 
+#endif /* USE_GAMEPAD */
+
+#if USE_EEPROM_INTERVAL
+
+/* The configuration descriptor of usbdrv.c, but in RAM: configInit() puts
+ * the poll interval (bInterval, in ms) from EEPROM_INTERVAL into the
+ * endpoint descriptor, an erased byte or 0 gives USB_CFG_INTR_POLL_INTERVAL.
+ * Anything else, 1 to 254 ms, is the range of a low speed bInterval.  With
+ * USE_POLL_SYNC it is capped at POLL_SYNC_MAX_MS, with USE_TURBO at
+ * TURBO_HALF, one half period per poll.
+ * Low speed devices should ask for 10 ms or more; many hosts poll faster
+ * when asked to, some round to a power of 2.
+ */
+#if USB_CFG_HAVE_INTRIN_ENDPOINT3 || USB_CFG_IS_SELF_POWERED
+#error "usbDescriptorConfiguration only has endpoint 1 and bus power"
+#endif
+
+/* usbdrv.c serves the HID descriptor at offset 18, so this can't be static */
+char usbDescriptorConfiguration[9 + 9 + 9 + 7] = {
+	9,                             // bLength
+	USBDESCR_CONFIG,               // bDescriptorType
+	9 + 9 + 9 + 7, 0,              // wTotalLength
+	1,                             // bNumInterfaces
+	1,                             // bConfigurationValue
+	0,                             // iConfiguration
+	1 << 7,                        // bmAttributes (bus powered)
+	USB_CFG_MAX_BUS_POWER / 2,     // bMaxPower (2 mA)
+	9,                             //   bLength
+	USBDESCR_INTERFACE,            //   bDescriptorType
+	0,                             //   bInterfaceNumber
+	0,                             //   bAlternateSetting
+	1,                             //   bNumEndpoints
+	USB_CFG_INTERFACE_CLASS,       //   bInterfaceClass
+	USB_CFG_INTERFACE_SUBCLASS,    //   bInterfaceSubClass
+	USB_CFG_INTERFACE_PROTOCOL,    //   bInterfaceProtocol
+	0,                             //   iInterface
+	9,                             //   bLength
+	USBDESCR_HID,                  //   bDescriptorType (HID)
+	0x01, 0x01,                    //   bcdHID (1.01)
+	0,                             //   bCountryCode
+	1,                             //   bNumDescriptors
+	USBDESCR_HID_REPORT,           //   bDescriptorType (report)
+	USB_CFG_HID_REPORT_DESCRIPTOR_LENGTH, 0, // wDescriptorLength
+	7,                             //   bLength
+	USBDESCR_ENDPOINT,             //   bDescriptorType
+	0x81,                          //   bEndpointAddress (IN 1)
+	0x03,                          //   bmAttributes (interrupt)
+	8, 0,                          //   wMaxPacketSize
+	USB_CFG_INTR_POLL_INTERVAL,    //   bInterval, see configInit()
+};
+
+/* longest interval USE_POLL_SYNC can lock to, in ms: Timer1 wraps after
+ * 256 counts, the interval and its jitter have to stay below that
+ */
+#define POLL_SYNC_MAX_MS    ((uchar)(250 * 1024.0 * 1000 / F_CPU))
+
+static void configInit(void)
+{
+	uchar interval = eeprom_read_byte(EEPROM_INTERVAL);
+
+	if (interval == 0 || interval == 0xff)
+	{
+		return; /* keep USB_CFG_INTR_POLL_INTERVAL */
+	}
+#if USE_POLL_SYNC
+	if (interval > POLL_SYNC_MAX_MS)
+	{
+		interval = POLL_SYNC_MAX_MS;
+	}
+#endif
+#if USE_TURBO
+	if (interval > TURBO_HALF)
+	{
+		interval = TURBO_HALF; /* see the check of TURBO_RATE */
+	}
+#endif
+	usbDescriptorConfiguration[sizeof(usbDescriptorConfiguration) - 1] = interval;
+}
+
+/* only asked for the configuration descriptor */
+usbMsgLen_t usbFunctionDescriptor(usbRequest_t *rq)
+{
+	(void)rq;
+	usbMsgPtr = (uchar *)usbDescriptorConfiguration;
+	return sizeof(usbDescriptorConfiguration);
+}
+
+#endif /* USE_EEPROM_INTERVAL */
+
 /* Keyboard usage values, see usb.org's HID-usage-tables document, chapter
  * 10 Keyboard/Keypad Page for more codes.
  */
@@ -235,6 +1964,7 @@ const PROGMEM char usbHidReportDescriptor[35] = {   /* USB report descriptor */
 #define KEY_0       39
 
 #define KEY_ENTER   40
+#define KEY_BACKSPACE 42
 
 #define KEY_F1      58
 #define KEY_F2      59
@@ -249,10 +1979,166 @@ const PROGMEM char usbHidReportDescriptor[35] = {   /* USB report descriptor */
 #define KEY_F11     68
 #define KEY_F12     69
 
-static void buildReport(uchar key)
+#define KEY_PAGEUP  75
+#define KEY_PAGEDOWN 78
+#define KEY_RIGHT   79
+#define KEY_LEFT    80
+
+/* ------------------------------------------------------------------------- */
+/* -------------------------------- Profiles ------------------------------- */
+/* ------------------------------------------------------------------------- */
+
+#if USE_PROFILES
+
+/* A profile binds a modifier mask and a key to each button.  The active
+ * one is copied to keymapBindings, so buildReport() only looks it up.
+ *
+ * The profiles live in EEPROM, an erased profile gives the one from
+ * keymapTable:
+ *   EEPROM_KEYMAP + 0       the active profile
+ *   EEPROM_KEYMAP + 1 + 4n  profile n: modifiers and key of button 1,
+ *                            then of button 2 (usage values, see below)
+ * Buttons held while plugging in select the profile with their bits
+ * (button 1: 1, button 2: 2, both: 3).  Holding both buttons for
+ * KEYMAP_SWITCH_TICKS switches to the next profile.  Either way the
+ * choice is stored, the buttons stay silent until they are released,
+ * and the LED blinks n + 1 times for profile n.
+ *
+ * Like a chord, the switch must not reach the host: a single press is held
+ * back for KEYMAP_WINDOW, and both buttons pressed within it stay silent
+ * until the switch.  A button released before that is sent as a tap, the
+ * other one as held.  keymapUpdate() runs on every change of keyState and,
+ * through TASK_KEYMAP, at the end of the window and of the switch time.
+ */
+#define KEYMAP_COUNT            4
+#define KEYMAP_WINDOW           10  /* ms a single press is held back */
+#define KEYMAP_SWITCH_TICKS     1000
+#define KEYMAP_BLINK_TICKS      150
+
+struct binding
+{
+	uchar modifiers;
+	uchar key;
+};
+
+static const PROGMEM struct binding keymapTable[KEYMAP_COUNT][NUM_KEYS] =
+{
+	/*********************************************/
+	/* EDIT BELOW FOR YOUR OWN PROFILES          */
+
+	{ { MOD_GUI_LEFT, 0 }, { 0, KEY_ENTER } },                     /* default */
+	{ { MOD_CONTROL_LEFT | MOD_SHIFT_LEFT, KEY_M },                /* voice chat: mute, */
+	  { MOD_CONTROL_LEFT | MOD_SHIFT_LEFT, KEY_O } },              /* camera */
+	{ { 0, KEY_LEFT }, { 0, KEY_RIGHT } },                         /* video editing: frame back, forward */
+	{ { 0, KEY_PAGEUP }, { 0, KEY_PAGEDOWN } },                    /* presentation: slide back, forward */
+
+	/* EDIT ABOVE FOR YOUR OWN PROFILES          */
+	/*********************************************/
+};
+
+static struct binding keymapBindings[NUM_KEYS]; /* the active profile */
+static uchar keymapActive;
+static uchar keymapDirty;           /* keymapActive has to go to EEPROM */
+static uchar keymapBlinks;          /* LED steps left of the blink pattern */
+static uint16_t keymapStep;         /* tick of the last step */
+static keys_t keymapLast;           /* keyState at the last update */
+static uint16_t keymapStart;        /* tick of the first press */
+
+static void keymapLoad(uchar n)
+{
+	uint8_t *stored = EEPROM_KEYMAP + 1 + n * sizeof(keymapBindings);
+
+	if (eeprom_read_byte(stored) == 0xff)
+	{
+		memcpy_P(keymapBindings, keymapTable[n], sizeof(keymapBindings));
+	}
+	else
+	{
+		eeprom_read_block(keymapBindings, stored, sizeof(keymapBindings));
+	}
+	keymapActive = n;
+	keymapBlinks = 2 * n + 3; /* a pause, then n + 1 blinks */
+	keymapStep = tickNow - KEYMAP_BLINK_TICKS;
+}
+
+/* after hardwareInit(): the stored profile, or the one held at plug-in */
+static void keymapInit(void)
+{
+	uchar n;
+
+	_delay_us(100); /* let the pull-ups charge the lines */
+	keymapMute = keyPressed();
+	earlyKeys &= ~keymapMute; /* held since the disconnect to pick the profile */
+	n = keymapMute;
+	if (n != 0 && n < KEYMAP_COUNT)
+	{
+		keymapDirty = 1;
+	}
+	else
+	{
+		n = eeprom_read_byte(EEPROM_KEYMAP);
+		if (n >= KEYMAP_COUNT)
+		{
+			n = 0;
+		}
+	}
+	keymapLoad(n);
+}
+
+static void keymapUpdate(void)
+{
+	keys_t pressed = keyState & ~keymapLast;
+	keys_t released = keymapLast & ~keyState;
+
+	keymapLast = keyState;
+	keymapMute &= keyState;
+	if (pressed == keyState && pressed != 0)
+	{
+		keymapStart = tickNow; /* the first press after all were up */
+	}
+	keyOnce |= keymapHeld & released; /* a tap that was held back */
+
+	if (keyState == (KEY1 | KEY2) && keymapMute == 0)
+	{
+		if ((uint16_t)(tickNow - keymapStart) < KEYMAP_WINDOW)
+		{
+			keymapHeld = KEY1 | KEY2;
+		}
+		else
+		{
+			keymapHeld |= pressed; /* the first one is out already */
+		}
+		taskDelay(TASK_KEYMAP, KEYMAP_SWITCH_TICKS);
+	}
+	else if (pressed == keyState && pressed != 0)
+	{
+		keymapHeld = pressed;
+		taskDelay(TASK_KEYMAP, KEYMAP_WINDOW);
+	}
+	else
+	{
+		keymapHeld = 0;
+	}
+}
+
+#endif /* USE_PROFILES */
+
+#if USE_GAMEPAD
+
+static PROFILED void buildReport(keys_t key)
+{
+	reportBuffer[0] = key;
+}
+
+#else /* USE_GAMEPAD */
+
+static PROFILED void buildReport(keys_t key)
 {
 	uchar modifiers = 0;
 	uchar keypos = 0;
+#if USE_KEY_LADDER || USE_PROFILES
+	uchar i;
+#endif
 
 	/*********************************************/
 	/* EDIT BELOW FOR YOUR OWN KEY CONFIGURATION */
@@ -268,12 +2154,65 @@ static void buildReport(uchar key)
 	if (key & KEY2)
 	{
 		// *two* keys, no modifiers
-		reportBuffer[++keypos] = KEY_A;
-		reportBuffer[++keypos] = KEY_B;
+		keyboardReport[++keypos] = KEY_A;
+		keyboardReport[++keypos] = KEY_B;
 	}
 
 	*/
 
+#if USE_KEY_LADDER
+
+	/* ladder on button 1: F1, F2, ..., ladder on button 2: 1, 2, ... */
+	for (i = 0; i < LADDER_KEYS; i++)
+	{
+		if (key & ((keys_t)1 << i))
+		{
+			keyboardReport[++keypos] = KEY_F1 + i;
+		}
+		if (key & ((keys_t)1 << (i + LADDER_KEYS)))
+		{
+			keyboardReport[++keypos] = KEY_1 + i;
+		}
+	}
+
+#elif USE_PROFILES
+
+	/* see keymapTable */
+	for (i = 0; i < NUM_KEYS; i++)
+	{
+		if (key & ((keys_t)1 << i))
+		{
+			modifiers |= keymapBindings[i].modifiers;
+			if (keymapBindings[i].key != 0)
+			{
+				keyboardReport[++keypos] = keymapBindings[i].key;
+			}
+		}
+	}
+
+#elif USE_TAP_HOLD
+
+	/* tap button 1 for F1, hold it for Ctrl; tap button 2 for Enter,
+	 * hold it for Shift */
+	if (key & KEY1)
+	{
+		keyboardReport[++keypos] = KEY_F1;
+	}
+	if (key & KEY1_HOLD)
+	{
+		modifiers |= MOD_CONTROL_LEFT;
+	}
+	if (key & KEY2)
+	{
+		keyboardReport[++keypos] = KEY_ENTER;
+	}
+	if (key & KEY2_HOLD)
+	{
+		modifiers |= MOD_SHIFT_LEFT;
+	}
+
+#else
+
 	if (key & KEY1)
 	{
 		// one modifier, no keys
@@ -283,15 +2222,49 @@ static void buildReport(uchar key)
 	if (key & KEY2)
 	{
 		// one key, no modifiers
-		reportBuffer[++keypos] = KEY_ENTER;
+		keyboardReport[++keypos] = KEY_ENTER;
+	}
+
+#if USE_CHORDS
+	if (key & KEY_CHORD)
+	{
+		// both buttons: Ctrl+Shift+M, mute in many voice chats
+		modifiers |= MOD_CONTROL_LEFT | MOD_SHIFT_LEFT;
+		keyboardReport[++keypos] = KEY_M;
+	}
+#endif
+
+#if USE_MULTI_TAP
+	/* button 2 tapped once, twice, three times: 1, 2, 3 */
+	if (key & KEY2_TAP1)
+	{
+		keyboardReport[++keypos] = KEY_1;
+	}
+	if (key & KEY2_TAP2)
+	{
+		keyboardReport[++keypos] = KEY_2;
+	}
+	if (key & KEY2_TAP3)
+	{
+		keyboardReport[++keypos] = KEY_3;
+	}
+	if (key & KEY2_UNDO)
+	{
+		keyboardReport[++keypos] = KEY_BACKSPACE;
 	}
+#endif
+
+#endif
 
 	/* EDIT ABOVE FOR YOUR OWN KEY CONFIGURATION */
 	/*********************************************/
 
 
 
-	reportBuffer[0] = modifiers;
+#if USE_PEDAL_AXIS
+	reportBuffer[0] = REPORT_ID_KEYBOARD;
+#endif
+	keyboardReport[0] = modifiers;
 	
 	if (keypos > KEYS_IN_REPORT)
 	{
@@ -299,17 +2272,183 @@ static void buildReport(uchar key)
 		keypos = 0;
 		while (keypos < KEYS_IN_REPORT)
 		{
-			reportBuffer[++keypos] = KEY_ERROR_ROLLOVER;
+			keyboardReport[++keypos] = KEY_ERROR_ROLLOVER;
 		}
 	}
 	else
 	{
-		/* fill remaining/unused keys in report with zero */
-		while (keypos < KEYS_IN_REPORT)
-		{
-			reportBuffer[++keypos] = 0;
-		}
+		/* fill remaining/unused keys in report with zero */
+		while (keypos < KEYS_IN_REPORT)
+		{
+			keyboardReport[++keypos] = 0;
+		}
+	}
+}
+
+#endif /* USE_GAMEPAD */
+
+#if USE_REPORT_TABLE
+
+/* All possible interrupt packets (report plus CRC16, the PID is toggled on
+ * arming) are built once at startup by running buildReport() for every key
+ * state, so buildReport() stays the only place for the key configuration.
+ * Arming the endpoint on a key change is then a plain copy instead of
+ * buildReport() plus the copy and CRC calculation in usbSetInterrupt().
+ *
+ * The packets are laid out like usbTxBuf1 (PID, report, CRC16) in 8 byte
+ * entries at the offset given by the button bits in BUTTON_PIN.  This lets
+ * the USB interrupt send the packet for the current buttons directly in
+ * USE_JIT_REPORT mode, see USB_TX1_PACKET_HOOK in usbconfig.h.
+ */
+#define PACKET_SIZE     (1 + sizeof(reportBuffer) + 2)
+#define BUTTON_MASK     (_BV(BUTTON1_BIT) | _BV(BUTTON2_BIT))
+
+#if BUTTON_MASK != 0x18
+#error "reportTable needs the buttons on bits 3 and 4"
+#endif
+
+/* read by the USB interrupt, so this can't be static */
+uchar reportTable[BUTTON_MASK + 8] __attribute__((aligned(32)));
+
+/* offset in reportTable for the key state: button bits as if read from the pins */
+static uchar packetOffset(uchar key)
+{
+	uchar pins = BUTTON_MASK;
+
+	if (key & KEY1)
+	{
+		pins &= ~_BV(BUTTON1_BIT);
+	}
+	if (key & KEY2)
+	{
+		pins &= ~_BV(BUTTON2_BIT);
+	}
+	return pins;
+}
+
+static void buildReportTable(void)
+{
+	uchar key, i;
+	uchar *packet;
+
+	for (key = 0; key < (1 << NUM_KEYS); key++)
+	{
+		packet = reportTable + packetOffset(key);
+		buildReport(key);
+		for (i = 0; i < sizeof(reportBuffer); i++)
+		{
+			packet[1 + i] = reportBuffer[i];
+		}
+		usbCrc16Append(packet + 1, sizeof(reportBuffer));
+	}
+}
+
+/* same as usbSetInterrupt() on the report of the given key state,
+ * only to be called when usbInterruptIsReady()
+ */
+static PROFILED void armReport(uchar key)
+{
+	usbTxBuf1[0] ^= USBPID_DATA0 ^ USBPID_DATA1; /* toggle token */
+#if USE_JIT_REPORT
+	/* the interrupt picks the packet when the host asks for it */
+	(void)key;
+#else
+	uchar *src = reportTable + packetOffset(key) + 1;
+	uchar *dst = usbTxBuf1 + 1;
+	uchar i = PACKET_SIZE - 1;
+
+	do
+	{
+		*dst++ = *src++;
+	}
+	while (--i);
+#endif
+	usbTxLen1 = PACKET_SIZE + 1; /* including sync byte */
+}
+
+#endif /* USE_REPORT_TABLE */
+
+#if USE_POLL_SYNC
+
+/* The host polls the interrupt endpoint at a fixed interval (bInterval,
+ * possibly rounded by the host) in step with its 1 ms frames.  We keep the
+ * endpoint armed, so every poll takes a report, and note when that happens
+ * in Timer1 ticks.  Once two intervals in a row agree, the buttons are only
+ * sampled and the report is only armed POLL_MARGIN before the next expected
+ * poll.  A report is never older than that, and the main loop has nothing
+ * to do for the rest of the interval.  If a poll is missed, the intervals
+ * stop agreeing and we fall back to arming whenever the endpoint is free.
+ *
+ * The host gets a report on every poll, not only on changes.  Timer1 wraps
+ * after 256 ticks (~16 ms), longer poll intervals never lock; configInit()
+ * does not serve one from EEPROM.
+ */
+#define POLL_TICKS(us)  ((uchar)((us) * (F_CPU / 1024.0) / 1e6 + 0.5))
+#define POLL_MARGIN     POLL_TICKS(300)     /* arm this long before the expected poll */
+#define POLL_JITTER     POLL_TICKS(200)     /* tolerated wobble of the poll interval */
+
+static uchar pollLast;          /* Timer1 when the host took the last report */
+static uchar pollInterval;      /* last measured poll interval */
+static uchar pollLocked;        /* pollInterval is confirmed */
+static uchar pollArmed;         /* our report is waiting for the host */
+
+/* called from the main loop, returns 1 when a report has to be armed now */
+static PROFILED uchar pollDue(void)
+{
+	uchar now = TCNT1;
+	uchar delta;
+
+	if (pollArmed)
+	{
+		if (!usbInterruptIsReady())
+		{
+			return 0; /* still waiting for the host */
+		}
+		/* the host has just taken our report */
+		delta = now - pollLast;
+		pollLast = now;
+		pollArmed = 0;
+		pollLocked = (uchar)(delta - pollInterval + POLL_JITTER) <= 2 * POLL_JITTER;
+		pollInterval = delta;
+	}
+	if (pollLocked && (uchar)(now - pollLast) < pollInterval - POLL_MARGIN)
+	{
+		OCR1A = pollLast + pollInterval - POLL_MARGIN; /* wake up from sleep in time */
+		return 0;
+	}
+	pollArmed = usbInterruptIsReady();
+	return pollArmed;
+}
+
+#endif /* USE_POLL_SYNC */
+
+/* Nothing may be armed on the interrupt endpoint before the host has sent
+ * SET_CONFIGURATION: the host resets the data toggle with it and would
+ * drop our first report as a repeated one, and a report armed during
+ * enumeration is stale by then.  The main loop collects the keys pressed
+ * until then in earlyKeys (hardwareInit() already during the disconnect)
+ * and calls reportRestart() once configured, so a pedal held (or tapped)
+ * while plugging in shows up in the first report.
+ * USB_RESET_HOOK clears usbConfiguration, a bus reset starts over.  With
+ * USE_JIT_REPORT the interrupt always sends the current buttons, so only
+ * a held key makes it into the first report there.
+ */
+static uchar configured;        /* usbConfiguration as last seen */
+
+static void reportRestart(void)
+{
+	if (!usbInterruptIsReady())
+	{
+		/* armed before a bus reset: take it back, the interrupt leaves
+		 * the buffer alone from then on
+		 */
+		usbTxLen1 = USBPID_NAK;
 	}
+	USB_SET_DATATOKEN1(USB_INITIAL_DATATOKEN);
+#if USE_POLL_SYNC
+	pollArmed = 0;
+	pollLocked = 0;
+#endif
 }
 
 uchar usbFunctionSetup(uchar data[8])
@@ -321,8 +2460,15 @@ uchar usbFunctionSetup(uchar data[8])
 	{
 		if (rq->bRequest == USBRQ_HID_GET_REPORT) /* wValue: ReportType (highbyte), ReportID (lowbyte) */
 		{
+#if USE_PEDAL_AXIS
+			if (rq->wValue.bytes[0] == REPORT_ID_PEDAL)
+			{
+				usbMsgPtr = pedalReport;
+				return sizeof(pedalReport);
+			}
+#endif
 			/* we only have one report type, so don't look at wValue */
-			buildReport(keyPressed());
+			buildReport(keyOutput());
 			return sizeof(reportBuffer);
 		}
 		else if(rq->bRequest == USBRQ_HID_GET_IDLE)
@@ -335,9 +2481,15 @@ uchar usbFunctionSetup(uchar data[8])
 			idleRate = rq->wValue.bytes[1];
 		}
 	}
+#if USE_PROFILER
+	else if ((rq->bmRequestType & USBRQ_TYPE_MASK) == USBRQ_TYPE_VENDOR)
+	{
+		return profileSetup(rq);
+	}
+#endif
 	else
 	{
-		/* no vendor specific requests implemented */
+		/* no other vendor specific requests implemented */
 	}
 	return 0;
 }
@@ -346,10 +2498,17 @@ uchar usbFunctionSetup(uchar data[8])
 /* ------------------------ Oscillator Calibration ------------------------- */
 /* ------------------------------------------------------------------------- */
 
-/* Calibrate the RC oscillator to 8.25 MHz. The core clock of 16.5 MHz is
- * derived from the 66 MHz peripheral clock by dividing. Our timing reference
- * is the Start Of Frame signal (a single SE0 bit) available immediately after
- * a USB RESET.
+#if RC_OSCILLATOR
+
+#if F_CPU != 12800000
+static uchar calibrationDirty;      /* OSCCAL has to go to EEPROM */
+#endif
+
+/* Calibrate the RC oscillator for a core clock of F_CPU.  At 16.5 MHz the RC
+ * oscillator runs at 8.25 MHz and the core clock is derived from the 66 MHz
+ * PLL output by dividing.  At 12.8 MHz the RC oscillator is the core clock.
+ * Our timing reference is the Start Of Frame signal (a single SE0 bit)
+ * available immediately after a USB RESET.
  */
 static void calibrateOscillator(void)
 {
@@ -376,6 +2535,7 @@ static void calibrateOscillator(void)
                 
 			OSCCAL = trialCal;
 			frameLength = usbMeasureFrameLength();
+			tickUpdate(); /* 1 to 2 ms since the last one, 14 of them in all */
 			
 			if (abs(frameLength-targetLength) < bestDeviation)
 			{
@@ -386,59 +2546,679 @@ static void calibrateOscillator(void)
 	}
 
 	OSCCAL = bestCal;
+#if USE_LED_PWM
+	ledFault = bestDeviation > targetLength / 64; /* beyond ~1.5% */
+	taskTrigger(TASK_LED);
+#endif
 }
 
 void usbEventResetReady(void)
 {
+#if F_CPU == 12800000
+	uchar calibrationValue;
+#endif
+
+	if (oscillatorCalibrated)
+	{
+		oscillatorCalibrated = 0;
+		return;
+	}
+
+	/* usbMeasureFrameLength() counts cycles, interrupts would disturb it */
+	cli();
 	calibrateOscillator();
-	eeprom_write_byte(0, OSCCAL); /* store the calibrated value in EEPROM */
+#if F_CPU == 12800000
+	/* EEPROM write timing comes from the RC oscillator, which is far above
+	 * its specified range now: write at the factory calibration
+	 */
+	calibrationValue = OSCCAL;
+	OSCCAL = factoryCalibration;
+	eeprom_write_byte(EEPROM_OSCCAL, calibrationValue);
+	eeprom_busy_wait();
+	OSCCAL = calibrationValue;
+	sei();
+#else
+	sei();
+	calibrationDirty = 1; /* persistTask() stores it in EEPROM */
+#endif
+}
+
+#else /* RC_OSCILLATOR */
+
+void usbEventResetReady(void)
+{
+	/* crystal clock, nothing to calibrate */
+}
+
+#endif /* RC_OSCILLATOR */
+
+/* ------------------------------------------------------------------------- */
+
+/* ------------------------------------------------------------------------- */
+/* --------------------------------- Tasks --------------------------------- */
+/* ------------------------------------------------------------------------- */
+
+#define DEBOUNCE_TICKS  5           /* a button change locks out further ones this long */
+
+#if USE_CHORDS && CHORD_WINDOW <= DEBOUNCE_TICKS
+#error "CHORD_WINDOW has to be longer than DEBOUNCE_TICKS"
+#endif
+
+#if USE_PROFILES && KEYMAP_WINDOW <= DEBOUNCE_TICKS
+#error "KEYMAP_WINDOW has to be longer than DEBOUNCE_TICKS"
+#endif
+
+static void usbTask(void)
+{
+	usbPoll();
+	if (!usbConfiguration)
+	{
+#if USE_LATCH
+		if (configured)
+		{
+			latchBusReset();
+			taskTrigger(TASK_LED);
+		}
+#endif
+		configured = 0;
+	}
+	else if (!configured)
+	{
+		configured = 1;
+		reportRestart();
+		taskTrigger(TASK_REPORT);
+	}
+}
+
+/* take over a new keyState */
+static void keyTake(keys_t keys)
+{
+#if USE_HANG
+	keys_t before = keyOutput();
+#endif
+
+	keyState = keys;
+#if USE_PROFILES
+	keymapUpdate();
+#endif
+#if USE_TAP_HOLD
+	tapHoldUpdate();
+#elif USE_CHORDS
+	chordUpdate();
+#elif USE_LATCH
+	latchUpdate(keys);
+	if (keys == (KEY1 | KEY2))
+	{
+		taskDelay(TASK_LATCH, LATCH_SWITCH_TICKS);
+	}
+	if (latchDirty)
+	{
+		taskTrigger(TASK_PERSIST);
+	}
+#elif USE_HANG
+	hangUpdate();
+#elif USE_MULTI_TAP
+	multiTapUpdate();
+#endif
+	if (!configured)
+	{
+		earlyKeys |= keyOutput();
+	}
+	taskTrigger(TASK_LED);
+#if USE_HANG
+	if (keyOutput() == before)
+	{
+		return; /* a release that hangs, or a press during the hang time */
+	}
+#endif
+	taskTrigger(TASK_REPORT);
+}
+
+static void inputTask(void)
+{
+	keyRaw = keyPressed();
+#if USE_RAPID_TRIGGER
+	if ((keyRaw ^ keyState) & KEY1)
+	{
+		/* decided in the ADC interrupt already, nothing to debounce */
+		keyTake(keyState ^ KEY1);
+	}
+#endif
+	if (keyRaw != keyState)
+	{
+		taskTrigger(TASK_DEBOUNCE);
+	}
+}
+
+/* A change is taken over at once and locks out further changes for
+ * DEBOUNCE_TICKS: no delay for the first edge, the bouncing after it is
+ * ignored.  What the buttons show after the lock-out counts again.
+ */
+static void debounceTask(void)
+{
+	uint16_t locked = tickNow - keyChanged;
+
+	if (locked < DEBOUNCE_TICKS)
+	{
+		taskDelay(TASK_DEBOUNCE, DEBOUNCE_TICKS - locked);
+		return;
+	}
+	if (keyRaw != keyState)
+	{
+		keyChanged = tickNow;
+		keyTake(keyRaw);
+	}
+}
+
+#if USE_POLL_SYNC
+
+static void reportTask(void)
+{
+	if (configured && pollDue())
+	{
+		/* the host sees the buttons as they are now in its next poll */
+#if USE_REPORT_TABLE
+		armReport(keyState | earlyKeys);
+#else
+		buildReport(keyOutput() | earlyKeys);
+		usbSetInterrupt(reportBuffer, sizeof(reportBuffer));
+#endif
+		earlyKeys = 0;
+		keyOnce = 0;
+#if USE_MULTI_TAP
+		keyOnce = multiNext;
+		multiNext = 0;
+#endif
+	}
+}
+
+#else /* USE_POLL_SYNC */
+
+/* triggered by a change of the buttons, and again after the idle time */
+static void reportTask(void)
+{
+	keys_t key;
+
+	if (!configured)
+	{
+		return; /* debounceTask() collects earlyKeys meanwhile */
+	}
+	if (!usbInterruptIsReady())
+	{
+		taskWait(TASK_REPORT);
+		return;
+	}
+#if USE_TURBO
+	turboUpdate();
+#endif
+	key = keyOutput() | earlyKeys;
+	earlyKeys = 0;
+	keyOnce = 0;
+#if USE_MULTI_TAP
+	keyOnce = multiNext; /* the upgrade goes out after its undo */
+	multiNext = 0;
+#endif
+#if USE_REPORT_TABLE
+	armReport(key);
+#else
+	buildReport(key);
+	usbSetInterrupt(reportBuffer, sizeof(reportBuffer));
+#endif
+	if (key != keyOutput())
+	{
+		taskTrigger(TASK_REPORT); /* a replayed press or tap, its release follows */
+	}
+	else if (idleRate != 0)
+	{
+		/* USB HID idle timer: send the current state again even if
+		 * nothing changed, idleRate is in 4 ms units */
+		taskDelay(TASK_REPORT, idleRate * 4);
+	}
+}
+
+#endif /* USE_POLL_SYNC */
+
+static void ledTask(void)
+{
+#if USE_LED_PWM
+	if (ledStatus())
+	{
+		return;
+	}
+#endif
+
+	/*********************************************/
+	/* EDIT BELOW FOR YOUR OWN LED CONFIGURATION */
+
+#if USE_PROFILES
+	if (keymapBlinks != 0)
+	{
+		/* the pattern of a new profile, key feedback after it */
+		uint16_t shown = tickNow - keymapStep;
+
+		if (shown < KEYMAP_BLINK_TICKS)
+		{
+			taskDelay(TASK_LED, KEYMAP_BLINK_TICKS - shown); /* woken early by a key */
+			return;
+		}
+		keymapStep = tickNow;
+		keymapBlinks--;
+		taskDelay(TASK_LED, KEYMAP_BLINK_TICKS);
+		if (keymapBlinks & 1)
+		{
+			LED_ON;
+			return;
+		}
+		if (keymapBlinks != 0)
+		{
+			LED_OFF;
+			return;
+		}
+	}
+#endif
+
+#if USE_LATCH
+	if (keyState == 0 && latchState == 0)
+#else
+	if (keyState == 0)
+#endif
+	{
+		LED_OFF;
+	}
+	else
+	{
+		LED_ON;
+	}
+
+	/* EDIT ABOVE FOR YOUR OWN LED CONFIGURATION */
+	/*********************************************/
+}
+
+/* EEPROM writes, each one when the EEPROM is ready for it.  At 12.8 MHz
+ * usbEventResetReady() writes the calibration itself, see there.
+ */
+static void persistTask(void)
+{
+#if RC_OSCILLATOR && F_CPU != 12800000
+	if (calibrationDirty && eeprom_is_ready())
+	{
+		eeprom_write_byte(EEPROM_OSCCAL, OSCCAL);
+		calibrationDirty = 0;
+	}
+#endif
+#if USE_LATCH
+	if (latchDirty && eeprom_is_ready())
+	{
+		/* one byte per run, only what changed */
+		if (eeprom_read_byte(EEPROM_LATCH) != latchConfig)
+		{
+			eeprom_write_byte(EEPROM_LATCH, latchConfig);
+			taskDelay(TASK_PERSIST, 4); /* a write takes 3.4 ms */
+		}
+		else
+		{
+			eeprom_update_byte(EEPROM_LATCH + 1, latchState);
+			latchDirty = 0;
+		}
+	}
+#endif
+#if USE_PROFILES
+	if (keymapDirty && eeprom_is_ready())
+	{
+		eeprom_write_byte(EEPROM_KEYMAP, keymapActive);
+		keymapDirty = 0;
+	}
+#endif
+}
+
+#if USE_LATCH
+
+/* both buttons have been down for LATCH_SWITCH_TICKS */
+static void latchTask(void)
+{
+	if (keyState == (KEY1 | KEY2) && (uint16_t)(tickNow - keyChanged) >= LATCH_SWITCH_TICKS)
+	{
+		latchSwitch();
+		taskTrigger(TASK_PERSIST);
+		taskTrigger(TASK_REPORT);
+		taskTrigger(TASK_LED);
+	}
+}
+
+#endif /* USE_LATCH */
+
+#if USE_PEDAL_AXIS
+
+/* Runs every other tick, once the filter has moved far enough a pedal
+ * report waits for a free interrupt endpoint.  The keyboard goes first:
+ * reportTask() comes before this one in every pass.
+ */
+static void pedalTask(void)
+{
+	uchar value = pedalPosition();
+	uchar sent = pedalReport[1];
+
+	if (value == sent)
+	{
+		return;
+	}
+	if (value != 0 && value != 255 && (uchar)(value - sent + PEDAL_DEADBAND - 1) < 2 * PEDAL_DEADBAND - 1)
+	{
+		return; /* within the deadband, the ends always get through */
+	}
+	if (!configured || !usbInterruptIsReady())
+	{
+		return; /* try again next time */
+	}
+	pedalReport[1] = value;
+	usbSetInterrupt(pedalReport, sizeof(pedalReport));
+}
+
+#endif /* USE_PEDAL_AXIS */
+
+#if USE_TAP_HOLD
+
+/* the tapping term of an undecided key is up */
+static void tapHoldTask(void)
+{
+	keys_t before = tapKeys;
+
+	tapHoldUpdate();
+	if (tapKeys != before)
+	{
+		taskTrigger(TASK_REPORT);
+	}
+}
+
+#endif /* USE_TAP_HOLD */
+
+#if USE_CHORDS
+
+/* the chord window of a single press is over */
+static void chordTask(void)
+{
+	keys_t before = chordKeys;
+
+	chordUpdate();
+	if (chordKeys != before)
+	{
+		taskTrigger(TASK_REPORT);
+	}
+}
+
+#endif /* USE_CHORDS */
+
+#if USE_HANG
+
+/* a hang time may be over */
+static void hangTask(void)
+{
+	keys_t before = hangKeys;
+	uchar i;
+
+	for (i = 0; i < 2; i++)
+	{
+		if ((hangKeys & (1 << i)) && (int16_t)(tickNow - hangUntil[i]) >= 0)
+		{
+			hangKeys &= ~(1 << i);
+		}
+	}
+	if (hangKeys != before)
+	{
+		taskTrigger(TASK_REPORT);
+	}
+	hangSchedule();
+}
+
+#endif /* USE_HANG */
+
+#if USE_MULTI_TAP
+
+/* the window after the last tap is over: the series is complete */
+static void multiTapTask(void)
+{
+	if (keyState & KEY2)
+	{
+		return; /* the next tap has begun, its release starts a new window */
+	}
+#if !MULTI_TAP_IMMEDIATE
+	if (multiCount != 0)
+	{
+		keyOnce |= KEY2_TAP1 << (multiCount - 1);
+		taskTrigger(TASK_REPORT);
+	}
+#endif
+	multiCount = 0;
+}
+
+#endif /* USE_MULTI_TAP */
+
+#if USE_PROFILES
+
+/* both buttons held long enough: the next profile, a single press at
+ * the end of the window: send it */
+static void keymapTask(void)
+{
+	if (keyState == (KEY1 | KEY2) && keymapMute == 0 &&
+	    (uint16_t)(tickNow - keyChanged) >= KEYMAP_SWITCH_TICKS)
+	{
+		keymapLoad(keymapActive + 1 < KEYMAP_COUNT ? keymapActive + 1 : 0);
+		keymapMute = keyState;
+		keymapHeld = 0;
+		keymapDirty = 1;
+		taskTrigger(TASK_PERSIST);
+		taskTrigger(TASK_REPORT);
+		taskTrigger(TASK_LED);
+	}
+	else if (keyState != (KEY1 | KEY2) && keymapHeld != 0)
+	{
+		keymapHeld = 0;
+		taskTrigger(TASK_REPORT);
+	}
+}
+
+#endif /* USE_PROFILES */
+
+struct task
+{
+	void (*run)(void);
+	uint16_t period;                /* ticks, EVERY_PASS or ON_TRIGGER */
+	uchar deadline;                 /* ticks it may get through late */
+};
+
+/* Deadline of the tasks that wait for the host to take a report: its poll
+ * interval and 2 ticks.  With USE_EEPROM_INTERVAL the interval is only known
+ * at runtime, taskRun() takes it from the configuration descriptor then.
+ */
+#if USE_EEPROM_INTERVAL
+#define POLL_DEADLINE   0xff
+#else
+#define POLL_DEADLINE   (USB_CFG_INTR_POLL_INTERVAL + 2)
+#endif
+
+/* in order of priority */
+static const PROGMEM struct task taskTable[TASK_COUNT] =
+{
+	[TASK_USB]      = { usbTask,      EVERY_PASS, 0 },
+	[TASK_INPUT]    = { inputTask,    EVERY_PASS, 0 },
+	[TASK_DEBOUNCE] = { debounceTask, ON_TRIGGER, 2 },
+#if USE_POLL_SYNC
+	[TASK_REPORT]   = { reportTask,   EVERY_PASS, 0 },
+#else
+	[TASK_REPORT]   = { reportTask,   ON_TRIGGER, POLL_DEADLINE },
+#endif
+	[TASK_LED]      = { ledTask,      ON_TRIGGER, 10 },
+	[TASK_PERSIST]  = { persistTask,  250,        10 },
+#if USE_KEY_LADDER
+	[TASK_LADDER]   = { ladderTask,   1,          1 },
+#endif
+#if USE_PEDAL_AXIS
+	[TASK_PEDAL]    = { pedalTask,    2,          4 },
+#endif
+#if USE_TAP_HOLD
+	[TASK_TAP_HOLD] = { tapHoldTask,  ON_TRIGGER, 2 },
+#endif
+#if USE_CHORDS
+	[TASK_CHORD]    = { chordTask,    ON_TRIGGER, 1 },
+#endif
+#if USE_TURBO
+	[TASK_TURBO]    = { turboTask,    ON_TRIGGER, POLL_DEADLINE },
+#endif
+#if USE_LATCH
+	[TASK_LATCH]    = { latchTask,    ON_TRIGGER, 10 },
+#endif
+#if USE_HANG
+	[TASK_HANG]     = { hangTask,     ON_TRIGGER, 2 },
+#endif
+#if USE_MULTI_TAP
+	[TASK_MULTI_TAP] = { multiTapTask, ON_TRIGGER, 2 },
+#endif
+#if USE_PROFILES
+	[TASK_KEYMAP]   = { keymapTask,   ON_TRIGGER, 10 },
+#endif
+};
+
+/* every task runs once at startup */
+static void taskInit(void)
+{
+	uchar i;
+
+	tickTimer = TCNT1;
+	for (i = 0; i < TASK_COUNT; i++)
+	{
+		taskState[i] = TASK_DUE;
+	}
+}
+
+/* One pass of the main loop: run what is due.  Returns the ticks until the
+ * next task is due, 0 for right away.
+ */
+static uint16_t taskRun(void)
+{
+	void (*run)(void);
+	uint16_t period, late, deadline, next = 0xffff;
+	uchar i;
+
+	tickUpdate();
+	for (i = 0; i < TASK_COUNT; i++)
+	{
+		period = pgm_read_word(&taskTable[i].period);
+		if (period != EVERY_PASS &&
+		    (taskState[i] == TASK_IDLE || (int16_t)(taskDue[i] - tickNow) > 0))
+		{
+			continue;
+		}
+		late = tickNow - taskDue[i];
+		taskState[i] = TASK_IDLE;
+		run = (void (*)(void))pgm_read_word(&taskTable[i].run);
+		run();
+		if (period == EVERY_PASS || taskState[i] == TASK_BLOCKED)
+		{
+			continue;
+		}
+		deadline = pgm_read_byte(&taskTable[i].deadline);
+#if USE_EEPROM_INTERVAL
+		if (deadline == POLL_DEADLINE)
+		{
+			deadline = (uchar)usbDescriptorConfiguration[sizeof(usbDescriptorConfiguration) - 1] + 2;
+		}
+#endif
+		if (late > deadline && taskMisses[i] != 0xff)
+		{
+			taskMisses[i]++;
+		}
+		if (taskState[i] == TASK_IDLE && period != ON_TRIGGER)
+		{
+			taskState[i] = TASK_DUE;
+			taskDue[i] += period;
+		}
+	}
+
+	tickUpdate();
+	for (i = 0; i < TASK_COUNT; i++)
+	{
+		if (taskState[i] != TASK_DUE)
+		{
+			continue;
+		}
+		if ((int16_t)(taskDue[i] - tickNow) <= 0)
+		{
+			return 0;
+		}
+		if (taskDue[i] - tickNow < next)
+		{
+			next = taskDue[i] - tickNow;
+		}
+	}
+	return next;
+}
+
+/* Settings tasta-sim depends on, as absolute symbols sim_<name> in the
+ * symbol table.  They take neither flash nor RAM, and show what a variant
+ * was really built with.
+ */
+#define SIM_EXPORT(name) \
+	asm volatile (".global sim_" #name "\n\t.set sim_" #name ", %0" :: "i" ((uint16_t)(name)))
+
+static void simExport(void)
+{
+	SIM_EXPORT(DEBOUNCE_TICKS);
+#if USE_KEY_LADDER
+	SIM_EXPORT(LADDER_KEYS);
+#endif
+#if USE_TAP_HOLD
+	SIM_EXPORT(TAPPING_TERM);
+#endif
+#if USE_HANG
+	SIM_EXPORT(HANG_TIME1);
+#endif
+#if USE_MULTI_TAP
+	SIM_EXPORT(MULTI_TAP_WINDOW);
+#endif
+#if USE_PROFILES
+	SIM_EXPORT(KEYMAP_SWITCH_TICKS);
+#endif
+#if USE_EEPROM_INTERVAL
+	SIM_EXPORT(EEPROM_INTERVAL);
+#endif
 }
 
 /* ------------------------------------------------------------------------- */
 
 int main(void)
 {
-	uchar key, lastKey = 0, keyDidChange = 0;
-	uchar idleCounter = 0;
+#if USE_IDLE_SLEEP
+	uint16_t next;
+#endif
 
 	hardwareInit();
+#if USE_PROFILES
+	keymapInit();
+#endif
+#if USE_EEPROM_INTERVAL
+	configInit();
+#endif
+#if USE_REPORT_TABLE
+	buildReportTable();
+#endif
+	taskInit();
+	simExport();
 	sei();
 	for (;;) /* main event loop */
 	{
 		wdt_reset();
-		usbPoll();
-		key = keyPressed();
-		if (lastKey != key)
-		{
-			lastKey = key;
-			keyDidChange = 1;
-		}
-		if (TIFR & (1<<TOV0)) /* ~63 ms timer */
-		{
-			TIFR = 1<<TOV0; /* clear overflow */
-			if (idleRate != 0)
-			{
-				if (idleCounter >= OVERFLOWS_4MS)
-				{
-					idleCounter -= OVERFLOWS_4MS;
-				}
-				else
-				{
-					/* USB HID poll timer reached
-					 * send current state regardless of real key change */
-					idleCounter = idleRate;
-					keyDidChange = 1;
-				}
-			}
-		}
-		if (keyDidChange && usbInterruptIsReady())
+#if USE_PROFILER
+		profileCollect();
+#endif
+#if USE_IDLE_SLEEP
+		next = taskRun();
+		if (next != 0)
 		{
-			keyDidChange = 0;
-			/* use last key and not current key status in order to avoid lost
-			   changes in key status. */
-			buildReport(lastKey);
-			usbSetInterrupt(reportBuffer, sizeof(reportBuffer));
+			idleSleep(next);
 		}
+#else
+		taskRun();
+#endif
 	}
 	return 0;
 }
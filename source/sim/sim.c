@@ -0,0 +1,368 @@
+/*
+ * tasta - simple USB keyboard for ATtiny85
+ * Copyright (C) 2015 Christian Garbs <mitch@cgarbs.de>
+ * Licensed under GNU GPL v2 or v3
+ *
+ * sim.c - glue between the benchmarks and simavr
+ */
+
+#include <math.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "sim_avr.h"
+#include "sim_elf.h"
+#include "sim_io.h"
+#include "sim_irq.h"
+#include "avr_adc.h"
+#include "avr_eeprom.h"
+#include "avr_ioport.h"
+
+#include "sim.h"
+
+avr_t *avr;
+
+void (*simStepHook)(void);
+avr_cycle_count_t simSleepCycles;
+avr_cycle_count_t simIsrCycles;
+unsigned long simIsrCount;
+avr_cycle_count_t simOsccalWrite;
+
+#define SPL_ADDRESS     0x5d        /* data space addresses on the ATtiny85 */
+#define SPH_ADDRESS     0x5e
+
+static uint16_t isrStackPointer;    /* SP to return to from the USB interrupt, 0 outside */
+static avr_cycle_count_t isrStart;
+
+static double oscillatorSpread;     /* 0: OSCCAL does nothing */
+static double oscillatorPll;
+static uint8_t oscillatorCal;
+
+static avr_irq_t *pinIrq[8];
+static avr_irq_t *analogIrq[2];
+
+struct symbol
+{
+	char name[64];
+	uint32_t address;
+	uint32_t size;                  /* 0 without avr-nm -S */
+};
+
+static struct symbol *symbols;
+static int symbolCount;
+
+static void loadSymbols(const char *sym)
+{
+	FILE *f;
+	char line[256], field[3][64];
+	unsigned long address, length;
+	int size = 0;
+
+	free(symbols);
+	symbols = NULL;
+	symbolCount = 0;
+
+	f = fopen(sym, "r");
+	if (f == NULL)
+	{
+		perror(sym);
+		exit(1);
+	}
+	while (fgets(line, sizeof(line), f))
+	{
+		/* "address [size] type name", the size only with avr-nm -S */
+		switch (sscanf(line, "%lx %63s %63s %63s", &address, field[0], field[1], field[2]))
+		{
+		case 3:
+			length = 0;
+			strcpy(field[2], field[1]);
+			break;
+		case 4:
+			length = strtoul(field[0], NULL, 16);
+			break;
+		default:
+			continue;
+		}
+		if (symbolCount == size)
+		{
+			size = size ? size * 2 : 256;
+			symbols = realloc(symbols, size * sizeof(*symbols));
+		}
+		strcpy(symbols[symbolCount].name, field[2]);
+		symbols[symbolCount].address = address;
+		symbols[symbolCount].size = length;
+		symbolCount++;
+	}
+	fclose(f);
+}
+
+static struct symbol *findSymbol(const char *name)
+{
+	int i;
+
+	for (i = 0; i < symbolCount; i++)
+	{
+		if (strcmp(symbols[i].name, name) == 0)
+		{
+			return &symbols[i];
+		}
+	}
+	fprintf(stderr, "symbol %s not found\n", name);
+	exit(1);
+}
+
+uint32_t simSymbol(const char *name)
+{
+	struct symbol *symbol = findSymbol(name);
+
+	if (symbol->address >= DATA_OFFSET)
+	{
+		return symbol->address - DATA_OFFSET;
+	}
+	return symbol->address;
+}
+
+uint32_t simSymbolSize(const char *name)
+{
+	struct symbol *symbol = findSymbol(name);
+
+	if (symbol->size == 0)
+	{
+		fprintf(stderr, "symbol %s has no size, use avr-nm -S\n", name);
+		exit(1);
+	}
+	return symbol->size;
+}
+
+/* also sees writes that don't change OSCCAL, like the final one of a search */
+static void osccalWrite(avr_t *core, avr_io_addr_t address, uint8_t value, void *param)
+{
+	core->data[address] = value;
+	simOsccalWrite = core->cycle;
+}
+
+void simInit(const char *elf, const char *sym, uint32_t frequency)
+{
+	elf_firmware_t firmware;
+	int i;
+
+	memset(&firmware, 0, sizeof(firmware));
+	if (elf_read_firmware(elf, &firmware) != 0)
+	{
+		fprintf(stderr, "can't read %s\n", elf);
+		exit(1);
+	}
+
+	avr = avr_make_mcu_by_name("attiny85");
+	if (avr == NULL)
+	{
+		fprintf(stderr, "simavr does not know the attiny85\n");
+		exit(1);
+	}
+	avr_init(avr);
+	avr_load_firmware(avr, &firmware);
+	avr->frequency = frequency;
+	avr->log = LOG_ERROR;
+
+	simSleepCycles = 0;
+	simIsrCycles = 0;
+	simIsrCount = 0;
+	simOsccalWrite = 0;
+	isrStackPointer = 0;
+	oscillatorSpread = 0;
+
+	for (i = 0; i < 8; i++)
+	{
+		pinIrq[i] = avr_io_getirq(avr, AVR_IOCTL_IOPORT_GETIRQ('B'), i);
+	}
+	analogIrq[0] = avr_io_getirq(avr, AVR_IOCTL_ADC_GETIRQ, ADC_IRQ_ADC2);
+	analogIrq[1] = avr_io_getirq(avr, AVR_IOCTL_ADC_GETIRQ, ADC_IRQ_ADC3);
+	avr->vcc = avr->avcc = avr->aref = SIM_VCC_MV;
+
+	avr_register_io_write(avr, OSCCAL_ADDRESS, osccalWrite, NULL);
+	loadSymbols(sym);
+
+	/* USB idle (J state) and no key pressed: simavr has no pull-ups */
+	simSetLines(0, 1);
+	simSetKeys(0);
+}
+
+void simSetEeprom(uint16_t address, uint8_t value)
+{
+	avr_eeprom_desc_t desc;
+
+	desc.ee = &value;
+	desc.offset = address;
+	desc.size = 1;
+	avr_ioctl(avr, AVR_IOCTL_EEPROM_SET, &desc);
+}
+
+/* RC oscillator frequency relative to 8 MHz on a typical chip: two
+ * overlapping ranges, roughly like the plots in the datasheet
+ */
+static double rcCurve(uint8_t osccal)
+{
+	if (osccal < 128)
+	{
+		return 0.5 + osccal * (0.9 / 127);
+	}
+	return 0.95 + (osccal - 128) * (1.1 / 127);
+}
+
+static void oscillatorUpdate(void)
+{
+	oscillatorCal = avr->data[OSCCAL_ADDRESS];
+	avr->frequency = 8e6 * oscillatorSpread * rcCurve(oscillatorCal) * oscillatorPll;
+}
+
+void simOscillator(double spread)
+{
+	int osccal, best = 0;
+
+	oscillatorPll = avr->frequency >= 16e6 ? 2 : 1;
+	oscillatorSpread = spread;
+
+	/* factory calibration: closest to 8 MHz */
+	for (osccal = 1; osccal < 256; osccal++)
+	{
+		if (fabs(spread * rcCurve(osccal) - 1) < fabs(spread * rcCurve(best) - 1))
+		{
+			best = osccal;
+		}
+	}
+	avr->data[OSCCAL_ADDRESS] = best;
+	oscillatorUpdate();
+}
+
+void simSetKeys(uint8_t keys)
+{
+	avr_raise_irq(pinIrq[BUTTON1_BIT], (keys & KEY1) ? 0 : 1);
+	avr_raise_irq(pinIrq[BUTTON2_BIT], (keys & KEY2) ? 0 : 1);
+}
+
+void simSetAnalog(uint8_t button, double level)
+{
+	avr_raise_irq(analogIrq[button], (uint32_t)(level * SIM_VCC_MV + 0.5));
+}
+
+void simSetLines(uint8_t dplus, uint8_t dminus)
+{
+	avr_raise_irq(pinIrq[DMINUS_BIT], dminus);
+	avr_raise_irq(pinIrq[DPLUS_BIT], dplus);
+}
+
+int simStep(void)
+{
+	avr_cycle_count_t start = avr->cycle;
+	int sleeping = avr->state == cpu_Sleeping;
+	int state = avr_run(avr);
+	uint16_t sp;
+
+	if (sleeping)
+	{
+		simSleepCycles += avr->cycle - start;
+	}
+
+	if (oscillatorSpread != 0 && avr->data[OSCCAL_ADDRESS] != oscillatorCal)
+	{
+		oscillatorUpdate();
+	}
+
+	/* the USB interrupt is over when the return address is off the stack */
+	sp = avr->data[SPL_ADDRESS] | avr->data[SPH_ADDRESS] << 8;
+	if (isrStackPointer == 0 && avr->pc == USB_VECTOR)
+	{
+		isrStackPointer = sp + 2;
+		isrStart = start;
+		simIsrCount++;
+	}
+	else if (isrStackPointer != 0 && sp >= isrStackPointer)
+	{
+		simIsrCycles += avr->cycle - isrStart;
+		isrStackPointer = 0;
+	}
+
+	if (simStepHook)
+	{
+		simStepHook();
+	}
+	return state != cpu_Done && state != cpu_Crashed;
+}
+
+int simRun(avr_cycle_count_t cycles)
+{
+	avr_cycle_count_t end = avr->cycle + cycles;
+
+	while (avr->cycle < end)
+	{
+		if (!simStep())
+		{
+			return 0;
+		}
+	}
+	return 1;
+}
+
+avr_cycle_count_t simRunUntil(volatile int *flag, avr_cycle_count_t limit)
+{
+	avr_cycle_count_t start = avr->cycle;
+
+	while (!*flag)
+	{
+		if (avr->cycle - start >= limit || !simStep())
+		{
+			return 0;
+		}
+	}
+	return avr->cycle - start;
+}
+
+avr_cycle_count_t simRunUntilChanged(uint32_t address, uint8_t value, avr_cycle_count_t limit)
+{
+	avr_cycle_count_t start = avr->cycle;
+
+	while (avr->data[address] == value)
+	{
+		if (avr->cycle - start >= limit || !simStep())
+		{
+			return 0;
+		}
+	}
+	return avr->cycle - start;
+}
+
+avr_cycle_count_t simUsToCycles(double us)
+{
+	return (avr_cycle_count_t)(us * avr->frequency / 1e6 + 0.5);
+}
+
+double simCyclesToUs(avr_cycle_count_t cycles)
+{
+	return cycles * 1e6 / avr->frequency;
+}
+
+void statsAdd(struct stats *s, double value)
+{
+	if (s->count == 0 || value < s->min)
+	{
+		s->min = value;
+	}
+	if (s->count == 0 || value > s->max)
+	{
+		s->max = value;
+	}
+	s->sum += value;
+	s->count++;
+}
+
+void statsPrint(const char *what, const struct stats *s, const char *unit)
+{
+	if (s->count == 0)
+	{
+		printf("%-28s %8s\n", what, "-");
+		return;
+	}
+	printf("%-28s %10.1f %10.1f %10.1f %s  (n=%lu)\n",
+	       what, s->min, s->sum / s->count, s->max, unit, s->count);
+}
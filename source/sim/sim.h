@@ -0,0 +1,109 @@
+/*
+ * tasta - simple USB keyboard for ATtiny85
+ * Copyright (C) 2015 Christian Garbs <mitch@cgarbs.de>
+ * Licensed under GNU GPL v2 or v3
+ *
+ * sim.h - glue between the benchmarks and simavr
+ */
+
+#ifndef __sim_h_included__
+#define __sim_h_included__
+
+#include <stdint.h>
+
+#include "sim_avr.h"
+
+/* pin assignments, see main.c */
+#define DMINUS_BIT      1
+#define DPLUS_BIT       2
+#define BUTTON2_BIT     3
+#define BUTTON1_BIT     4
+
+#define KEY1            (1 << 0)
+#define KEY2            (1 << 1)
+
+#define SIM_VCC_MV      5000        /* supply and ADC reference */
+
+#define DATA_OFFSET     0x800000    /* data addresses in the symbol table */
+#define USB_VECTOR      0x0002      /* INT0, byte address */
+#define OSCCAL_ADDRESS  0x51        /* data space addresses */
+#define MCUSR_ADDRESS   0x54
+
+extern avr_t *avr;
+
+/* load firmware and symbol table (output of avr-nm -S), core clock in Hz */
+void simInit(const char *elf, const char *sym, uint32_t frequency);
+
+/* address of a symbol, data symbols are returned as index into avr->data,
+ * absolute ones like the sim_* settings of main.c give their value
+ */
+uint32_t simSymbol(const char *name);
+
+/* size in bytes of a symbol, needs a symbol table from avr-nm -S */
+uint32_t simSymbolSize(const char *name);
+
+/* write a byte of the simulated EEPROM */
+void simSetEeprom(uint16_t address, uint8_t value);
+
+/* set the key state (KEY1 | KEY2), pressed keys pull their pin low */
+void simSetKeys(uint8_t keys);
+
+/* voltage on the pin of button 1 (0) or 2 (1) as a share of VCC, for the
+ * ladders of USE_KEY_LADDER and the pedal of USE_PEDAL_AXIS
+ */
+void simSetAnalog(uint8_t button, double level);
+
+/* drive the USB data lines from the outside */
+void simSetLines(uint8_t dplus, uint8_t dminus);
+
+/* called after every simulated instruction (or sleep period) */
+extern void (*simStepHook)(void);
+
+/* Model the RC oscillator: from now on OSCCAL changes the core clock like on
+ * a chip whose oscillator runs "spread" times as fast as a typical one.
+ * OSCCAL starts at the factory value for 8 MHz.  The core clock is twice
+ * the RC clock (PLL) for firmware built for 16 MHz or more.
+ */
+void simOscillator(double spread);
+
+/* cycle of the last write to OSCCAL, 0 if there was none */
+extern avr_cycle_count_t simOsccalWrite;
+
+/* cycles the core spent in sleep mode so far */
+extern avr_cycle_count_t simSleepCycles;
+
+/* cycles spent in the USB interrupt (INT0) so far and how often it ran */
+extern avr_cycle_count_t simIsrCycles;
+extern unsigned long simIsrCount;
+
+/* run one instruction, returns 0 if the core died */
+int simStep(void);
+
+/* run for the given number of cycles, returns 0 if the core died */
+int simRun(avr_cycle_count_t cycles);
+
+/* run until *flag != 0 or the cycle limit is reached, returns the cycles
+ * needed or 0 on timeout
+ */
+avr_cycle_count_t simRunUntil(volatile int *flag, avr_cycle_count_t limit);
+
+/* run until the byte at the data address changes from the given value */
+avr_cycle_count_t simRunUntilChanged(uint32_t address, uint8_t value, avr_cycle_count_t limit);
+
+/* convert between microseconds and cycles */
+avr_cycle_count_t simUsToCycles(double us);
+double simCyclesToUs(avr_cycle_count_t cycles);
+
+/* simple statistics */
+struct stats
+{
+	unsigned long count;
+	double sum;
+	double min;
+	double max;
+};
+
+void statsAdd(struct stats *s, double value);
+void statsPrint(const char *what, const struct stats *s, const char *unit);
+
+#endif /* __sim_h_included__ */
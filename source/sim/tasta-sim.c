@@ -0,0 +1,1784 @@
+/*
+ * tasta - simple USB keyboard for ATtiny85
+ * Copyright (C) 2015 Christian Garbs <mitch@cgarbs.de>
+ * Licensed under GNU GPL v2 or v3
+ *
+ * tasta-sim - run the firmware in simavr and measure things
+ *
+ * usage: tasta-sim [-f main.elf] [-s main.sym] [-c clock] scenario
+ */
+
+#include <math.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "sim.h"
+#include "sim_cycle_timers.h"
+#include "usbhost.h"
+
+#define BOOT_MS         300         /* hardwareInit() fakes a 255 ms disconnect */
+#define POLL_FRAMES     10          /* bInterval of the interrupt endpoint */
+/* key changes lock out further ones for DEBOUNCE_TICKS of main.c */
+#define DEBOUNCE_MS     ((int)simSymbol("sim_DEBOUNCE_TICKS") + 1)
+
+/* tasks of main.c in the order of taskMisses */
+static const char *const taskNames[] = { "usb", "input", "debounce", "report", "led", "persist" };
+
+/* Assumed supply current at 5 V per MHz of core clock, roughly the typical
+ * values of the ATtiny85 datasheet DC characteristics.  The PLL needed for
+ * 16.5 MHz draws extra current which is not included.
+ */
+#define ACTIVE_MA_PER_MHZ   0.625
+#define IDLE_MA_PER_MHZ     0.15
+
+/* default key configuration of main.c */
+#define MOD_GUI_LEFT    (1<<3)
+#define KEY_ENTER       40
+
+static unsigned long iterations = 1000;
+
+/* the sweeps reload the firmware for every step */
+static const char *elfFile = "main.elf", *symFile = "main.sym";
+static uint32_t coreClock = 16500000;
+
+/* small deterministic pseudo random numbers, so runs are comparable */
+static uint32_t randomState = 1;
+
+static uint32_t randomNumber(uint32_t max)
+{
+	randomState = randomState * 1103515245 + 12345;
+	return (randomState >> 16) % max;
+}
+
+/* boot the firmware loaded by simInit() and enumerate it as the only device
+ * on the bus, returns the ms the enumeration took
+ */
+static double bootAndEnumerate(void)
+{
+	avr_cycle_count_t start;
+
+	usbHostInit();
+	simRun(simUsToCycles(BOOT_MS * 1000.0));
+	start = avr->cycle;
+	if (usbHostEnumerate() != 0)
+	{
+		fprintf(stderr, "enumeration failed\n");
+		exit(1);
+	}
+	return simCyclesToUs(avr->cycle - start) / 1000;
+}
+
+/* ------------------------------------------------------------------------- */
+
+/* Time from a key change to the interrupt packet being armed.  Nobody polls
+ * the endpoint, so we take the packet away ourselves afterwards.
+ */
+static void scenarioArm(void)
+{
+	static const uint8_t sequence[] = { KEY1, KEY1 | KEY2, KEY2, 0 };
+	uint32_t txLen = simSymbol("usbTxStatus1");  /* len is the first member */
+	struct stats armed = { 0 };
+	avr_cycle_count_t cycles;
+	unsigned long i;
+
+	simRun(simUsToCycles(BOOT_MS * 1000.0));
+	/* no host here: pretend to be configured and drop the first report */
+	avr->data[simSymbol("usbConfiguration")] = 1;
+	simRun(simUsToCycles(1000));
+	avr->data[txLen] = USBPID_NAK;
+
+	for (i = 0; i < iterations; i++)
+	{
+		/* change keys at some random point in the main loop, after the
+		 * debounce lock-out of the last change */
+		simRun(simUsToCycles(DEBOUNCE_MS * 1000.0) + randomNumber(2000));
+		simSetKeys(sequence[i % sizeof(sequence)]);
+		cycles = simRunUntilChanged(txLen, USBPID_NAK, simUsToCycles(10000));
+		if (cycles == 0)
+		{
+			fprintf(stderr, "no packet armed after key change %lu\n", i);
+			exit(1);
+		}
+		statsAdd(&armed, cycles);
+		avr->data[txLen] = USBPID_NAK;
+	}
+
+	printf("%-28s %10s %10s %10s\n", "", "min", "avg", "max");
+	statsPrint("key change to armed packet", &armed, "cycles");
+}
+
+/* ------------------------------------------------------------------------- */
+
+/* keys as seen by the host in a report of the default key configuration */
+static uint8_t reportKeys(const uint8_t *report)
+{
+	uint8_t keys = 0;
+
+	if (report[0] & MOD_GUI_LEFT)
+	{
+		keys |= KEY1;
+	}
+	if (report[1] == KEY_ENTER || report[2] == KEY_ENTER)
+	{
+		keys |= KEY2;
+	}
+	return keys;
+}
+
+/* deadline misses of the scheduler in main.c */
+static void printTaskMisses(void)
+{
+	uint32_t misses = simSymbol("taskMisses");
+	unsigned count = simSymbolSize("taskMisses");
+	unsigned i;
+
+	printf("%-28s", "deadline misses");
+	for (i = 0; i < count; i++)
+	{
+		/* the optional tasks are numbered, which ones exist depends on the build */
+		if (i < sizeof(taskNames) / sizeof(taskNames[0]))
+		{
+			printf(" %s %u", taskNames[i], avr->data[misses + i]);
+		}
+		else
+		{
+			printf(" task%u %u", i, avr->data[misses + i]);
+		}
+	}
+	printf("\n");
+}
+
+/* A host polls the interrupt endpoint every POLL_FRAMES ms while the keys
+ * change once or twice between polls.  Shows how old the reports are when
+ * they arrive and how long the device takes to answer the IN token.
+ */
+static void scenarioPoll(void)
+{
+	static const uint8_t sequence[] = { KEY1, KEY1 | KEY2, KEY2, 0 };
+	uint8_t report[8], keys = 0;
+	avr_cycle_count_t changed = 0;
+	struct stats latency = { 0 };
+	unsigned long i, reports = 0, stale = 0, step = 0;
+	int len, frame, first, second, pending = 0;
+
+	bootAndEnumerate();
+
+	for (i = 0; i < iterations; i++)
+	{
+		/* key changes early enough in their frame for the main loop to react */
+		first = randomNumber(POLL_FRAMES - 1);
+		second = randomNumber(2) ? (int)randomNumber(POLL_FRAMES - 1) : -1;
+		if (abs(second - first) < DEBOUNCE_MS)
+		{
+			second = -1; /* would be held back by the debouncing */
+		}
+		for (frame = 0; frame < POLL_FRAMES - 1; frame++)
+		{
+			if (!usbHostWaitFrame())
+			{
+				fprintf(stderr, "core stopped\n");
+				exit(1);
+			}
+			if (frame == first || frame == second)
+			{
+				simRun(randomNumber(simUsToCycles(800)));
+				keys = sequence[step++ % sizeof(sequence)];
+				simSetKeys(keys);
+				changed = avr->cycle;
+				pending = 1;
+			}
+		}
+
+		/* the poll itself goes out at the start of the next frame */
+		usbHostWaitFrame();
+		len = usbHostIn(USBHOST_ADDRESS, 1, report);
+		if (len == USBHOST_NAK)
+		{
+			continue;
+		}
+		if (len != 3)
+		{
+			fprintf(stderr, "bad interrupt transfer: %d\n", len);
+			exit(1);
+		}
+		reports++;
+		if (reportKeys(report) != keys)
+		{
+			stale++;
+		}
+		else if (pending)
+		{
+			statsAdd(&latency, simCyclesToUs(avr->cycle - changed));
+			pending = 0;
+		}
+	}
+
+	printf("%-28s %10s %10s %10s\n", "", "min", "avg", "max");
+	statsPrint("key change to report", &latency, "us");
+	printf("%-28s %10lu\n", "reports", reports);
+	printf("%-28s %10lu\n", "stale reports", stale);
+	printf("%-28s %10.2f bit times, %.0f cycles (limit %.1f bit times)\n",
+		"max turnaround", usbHostStats.maxTurnaround,
+		usbHostStats.maxTurnaround * usbHostBitCycles(), USBHOST_MAX_TURNAROUND);
+	printf("%-28s %10lu timeouts, %lu errors, %lu retries\n",
+		"bus", usbHostStats.timeouts, usbHostStats.errors, usbHostStats.retries);
+	printTaskMisses();
+}
+
+/* ------------------------------------------------------------------------- */
+
+/* Share of the time the core is awake while a host polls every POLL_FRAMES
+ * ms and a key changes about every 100 ms.  Runs for "iterations" polls.
+ */
+static void scenarioDuty(void)
+{
+	static const uint8_t sequence[] = { KEY1, 0, KEY2, 0 };
+	uint8_t report[8];
+	avr_cycle_count_t start, sleeping;
+	double awake, mhz = avr->frequency / 1e6;
+	unsigned long i, step = 0;
+	int frame, change;
+
+	bootAndEnumerate();
+
+	start = avr->cycle;
+	sleeping = simSleepCycles;
+	for (i = 0; i < iterations; i++)
+	{
+		change = randomNumber(10) == 0 ? (int)randomNumber(POLL_FRAMES) : -1;
+		for (frame = 0; frame < POLL_FRAMES; frame++)
+		{
+			if (!usbHostWaitFrame())
+			{
+				fprintf(stderr, "core stopped\n");
+				exit(1);
+			}
+			if (frame == change)
+			{
+				simRun(randomNumber(simUsToCycles(800)));
+				simSetKeys(sequence[step++ % sizeof(sequence)]);
+			}
+		}
+		if (usbHostIn(USBHOST_ADDRESS, 1, report) < USBHOST_NAK)
+		{
+			fprintf(stderr, "interrupt transfer failed\n");
+			exit(1);
+		}
+	}
+
+	awake = 1.0 - (double)(simSleepCycles - sleeping) / (avr->cycle - start);
+	printf("%-28s %10.1f ms\n", "simulated", simCyclesToUs(avr->cycle - start) / 1000);
+	printf("%-28s %10.1f %%\n", "core awake", 100.0 * awake);
+	printf("%-28s %10.2f mA (estimated, without PLL)\n", "supply current",
+		mhz * (awake * ACTIVE_MA_PER_MHZ + (1.0 - awake) * IDLE_MA_PER_MHZ));
+	printf("%-28s %10lu timeouts, %lu errors, %lu retries\n",
+		"bus", usbHostStats.timeouts, usbHostStats.errors, usbHostStats.retries);
+	printTaskMisses();
+}
+
+/* ------------------------------------------------------------------------- */
+
+#define STORM_QUEUE     64
+
+static const uint8_t stormSequence[] = { KEY1, KEY1 | KEY2, KEY2, 0 };
+
+/* key changes not seen by the host yet, oldest first */
+static struct
+{
+	avr_cycle_count_t when;
+	uint8_t keys;
+} stormQueue[STORM_QUEUE];
+static int stormQueued;
+static unsigned long stormChanges;
+
+static avr_cycle_count_t stormTimer(avr_t *core, avr_cycle_count_t when, void *param)
+{
+	uint8_t keys = stormSequence[stormChanges++ % sizeof(stormSequence)];
+
+	simSetKeys(keys);
+	if (stormQueued == STORM_QUEUE)
+	{
+		memmove(stormQueue, stormQueue + 1, (STORM_QUEUE - 1) * sizeof(stormQueue[0]));
+		stormQueued--;
+	}
+	stormQueue[stormQueued].when = when;
+	stormQueue[stormQueued].keys = keys;
+	stormQueued++;
+	return when + simUsToCycles(500 + randomNumber(2500));
+}
+
+/* Enumeration, then a key change every 0.5 to 3 ms while the host polls
+ * every POLL_FRAMES ms, "iterations" polls long.  Prints one row:
+ *  - cycles in the USB interrupt per bus transaction of the host
+ *  - share of the time the core sleeps (needs USE_IDLE_SLEEP=1)
+ *  - worst time from a key change to the report showing it; a report
+ *    shows the newest queued change with the same keys
+ *  - reports not showing the keys of the newest change (stale); changes
+ *    within the debounce lock-out of the firmware come late by design
+ *  - time from the bus reset to the configured device
+ */
+static void scenarioStorm(void)
+{
+	uint8_t report[8], keys;
+	avr_cycle_count_t start, sleeping, isrCycles;
+	unsigned long i, transactions, reports = 0, stale = 0;
+	double enumerated, latency, worst = 0;
+	int len, frame, j;
+
+	enumerated = bootAndEnumerate();
+
+	start = avr->cycle;
+	sleeping = simSleepCycles;
+	isrCycles = simIsrCycles;
+	transactions = usbHostStats.transactions;
+	avr_cycle_timer_register(avr, simUsToCycles(500), stormTimer, NULL);
+
+	for (i = 0; i < iterations; i++)
+	{
+		for (frame = 0; frame < POLL_FRAMES; frame++)
+		{
+			if (!usbHostWaitFrame())
+			{
+				fprintf(stderr, "core stopped\n");
+				exit(1);
+			}
+		}
+		len = usbHostIn(USBHOST_ADDRESS, 1, report);
+		if (len == USBHOST_NAK)
+		{
+			continue;
+		}
+		if (len != 3)
+		{
+			fprintf(stderr, "bad interrupt transfer: %d\n", len);
+			exit(1);
+		}
+		reports++;
+		keys = reportKeys(report);
+		for (j = stormQueued - 1; j >= 0 && stormQueue[j].keys != keys; j--)
+			;
+		if (j != stormQueued - 1)
+		{
+			stale++;
+		}
+		if (j < 0)
+		{
+			continue; /* no news */
+		}
+		latency = simCyclesToUs(avr->cycle - stormQueue[j].when);
+		if (latency > worst)
+		{
+			worst = latency;
+		}
+		stormQueued -= j + 1;
+		memmove(stormQueue, stormQueue + j + 1, stormQueued * sizeof(stormQueue[0]));
+	}
+	avr_cycle_timer_cancel(avr, stormTimer, NULL);
+
+	printf("%10.0f %9.1f%% %9.2fms %9.1f%% %9.1fms\n",
+		(double)(simIsrCycles - isrCycles) / (usbHostStats.transactions - transactions),
+		100.0 * (simSleepCycles - sleeping) / (avr->cycle - start),
+		worst / 1000,
+		reports ? 100.0 * stale / reports : 0.0,
+		enumerated);
+}
+
+/* ------------------------------------------------------------------------- */
+
+#define TRIAL_POLLS     100
+
+struct trial
+{
+	int enumerated;
+	unsigned long retries;          /* repeated transactions */
+	unsigned long failed;           /* interrupt transfers without a valid answer */
+	unsigned long wrong;            /* reports not showing the keys */
+	struct stats latency;           /* key change to report */
+};
+
+/* boot, enumerate and TRIAL_POLLS interrupt transfers with a key change
+ * halfway between each two of them
+ */
+static void runTrial(struct trial *t)
+{
+	static const uint8_t sequence[] = { KEY1, KEY1 | KEY2, KEY2, 0 };
+	uint8_t report[8], keys = 0;
+	avr_cycle_count_t changed = 0;
+	unsigned long i;
+	int frame, len;
+
+	memset(t, 0, sizeof(*t));
+	usbHostInit();
+	simRun(simUsToCycles(BOOT_MS * 1000.0));
+	t->enumerated = usbHostEnumerate() == 0;
+	if (t->enumerated)
+	{
+		for (i = 0; i < TRIAL_POLLS; i++)
+		{
+			for (frame = 0; frame < POLL_FRAMES; frame++)
+			{
+				usbHostWaitFrame();
+				if (frame == POLL_FRAMES / 2)
+				{
+					keys = sequence[i % sizeof(sequence)];
+					simSetKeys(keys);
+					changed = avr->cycle;
+				}
+			}
+			len = usbHostIn(USBHOST_ADDRESS, 1, report);
+			if (len != 3)
+			{
+				t->failed++;
+			}
+			else if (reportKeys(report) != keys)
+			{
+				t->wrong++;
+			}
+			else
+			{
+				statsAdd(&t->latency, simCyclesToUs(avr->cycle - changed));
+			}
+		}
+	}
+	t->retries = usbHostStats.retries;
+}
+
+static void printTrialHeader(const char *first)
+{
+	printf("%s %10s %8s %8s %8s %12s\n", first, "enumerated", "retries", "failed", "wrong", "latency us");
+}
+
+static void printTrial(const struct trial *t)
+{
+	printf(" %10s %8lu %8lu %8lu %12.0f\n", t->enumerated ? "yes" : "NO", t->retries,
+		t->failed, t->wrong, t->latency.count ? t->latency.sum / t->latency.count : 0.0);
+}
+
+/* Core clock off by -3 % to +3 % in 0.25 % steps, OSCCAL does nothing:
+ * how far off may the clock be after calibration?
+ */
+static void scenarioTolerance(void)
+{
+	struct trial t;
+	int step;
+
+	printTrialHeader("clock error");
+	for (step = -12; step <= 12; step++)
+	{
+		simInit(elfFile, symFile, coreClock * (1 + step * 0.0025));
+		runTrial(&t);
+		printf("%+10.2f%%", step * 0.25);
+		printTrial(&t);
+	}
+}
+
+/* Chips with RC oscillators from 10 % slower to 10 % faster than typical,
+ * starting at the factory calibration: does calibrateOscillator() find a
+ * good OSCCAL, and how close does it get?
+ */
+static void scenarioCalibration(void)
+{
+	struct trial t;
+	int step;
+
+	printf("%-8s %6s %9s", "spread", "OSCCAL", "error");
+	printTrialHeader("");
+	for (step = -5; step <= 5; step++)
+	{
+		simInit(elfFile, symFile, coreClock);
+		simOscillator(1 + step * 0.02);
+		runTrial(&t);
+		printf("%+7d%% %6d %+8.2f%%", step * 2, avr->data[OSCCAL_ADDRESS],
+			((double)avr->frequency / coreClock - 1) * 100);
+		printTrial(&t);
+	}
+}
+
+/* ------------------------------------------------------------------------- */
+
+#define PORF            (1 << 0)    /* reset causes in MCUSR */
+#define EXTRF           (1 << 1)
+#define BORF            (1 << 2)
+#define WDRF            (1 << 3)
+
+/* From reset to the configured device for every reset cause.  The host
+ * debounces the attach for 100 ms like a hub, then enumerates.  OSCCAL is
+ * modelled; the first boot starts with an empty EEPROM, all others with
+ * the OSCCAL found then.  The start-up time set by the fuses is not
+ * included.  KEY1 is held from reset on, like a pedal pressed while
+ * plugging in: the first report after SET_CONFIGURATION has to show it.
+ */
+static void scenarioBoot(void)
+{
+	static const struct
+	{
+		const char *name;
+		uint8_t mcusr;
+	}
+	causes[] =
+	{
+		{ "first boot", PORF },
+		{ "power-on",  PORF },
+		{ "external",  EXTRF },
+		{ "brown-out", BORF },
+		{ "watchdog",  WDRF },
+		{ "unknown",   0 },
+	};
+	avr_cycle_count_t start, low, configured;
+	double attached;
+	uint8_t calibration = 0xff, report[8];
+	unsigned i, polls;
+	int len;
+
+	printf("%-11s %12s %12s %12s %8s %12s\n", "reset", "disconnect", "attached", "configured", "retries", "held key");
+	for (i = 0; i < sizeof(causes) / sizeof(causes[0]); i++)
+	{
+		simInit(elfFile, symFile, coreClock);
+		simOscillator(1.0);
+		simSetEeprom(0, calibration);
+		avr->data[MCUSR_ADDRESS] = causes[i].mcusr;
+		simSetKeys(KEY1);
+
+		usbHostInit();
+		start = avr->cycle;
+		if (!usbHostAttach(100, &low))
+		{
+			fprintf(stderr, "core stopped\n");
+			exit(1);
+		}
+		attached = simCyclesToUs(avr->cycle - start) / 1000;
+		printf("%-11s %10.1fms %10.1fms ", causes[i].name, simCyclesToUs(low) / 1000, attached);
+		if (usbHostEnumerate() != 0)
+		{
+			printf("%12s %8lu\n", "FAILED", usbHostStats.retries);
+			continue;
+		}
+		configured = avr->cycle;
+		printf("%10.1fms %8lu ", simCyclesToUs(configured - start) / 1000, usbHostStats.retries);
+
+		/* poll the interrupt endpoint once per frame for the first report */
+		len = USBHOST_NAK;
+		for (polls = 0; polls < 100 && len == USBHOST_NAK; polls++)
+		{
+			usbHostWaitFrame();
+			len = usbHostIn(USBHOST_ADDRESS, 1, report);
+		}
+		if (len != 3 || reportKeys(report) != KEY1)
+		{
+			printf("%12s\n", usbHostStats.dropped ? "DROPPED" : "LOST");
+		}
+		else
+		{
+			printf("%10.1fms\n", simCyclesToUs(avr->cycle - configured) / 1000);
+		}
+		if (i == 0)
+		{
+			calibration = avr->data[OSCCAL_ADDRESS];
+		}
+	}
+}
+
+/* Where the time goes after a hub power cycle: power-on reset with the
+ * OSCCAL of an earlier boot in EEPROM.  One row, all in ms since reset:
+ * the device connects (stops pulling D- low), the host has debounced the
+ * attach, OSCCAL is written for the last time, the host has sent
+ * SET_CONFIGURATION, the first interrupt report arrives.  The host
+ * enumerates right after the attach and then polls the interrupt endpoint
+ * every POLL_FRAMES ms.  Crystal clocks have nothing to calibrate.
+ */
+static void scenarioStartup(void)
+{
+	int rc = coreClock == 16500000 || coreClock == 12800000;
+	avr_cycle_count_t low, attached, report = 0;
+	uint8_t calibration = 0xff, data[8];
+	unsigned pass, polls, i;
+	int len;
+
+	/* the first pass only finds the OSCCAL to store */
+	for (pass = 0; pass < 2; pass++)
+	{
+		simInit(elfFile, symFile, coreClock);
+		if (rc)
+		{
+			simOscillator(1.0);
+			simSetEeprom(0, calibration);
+		}
+		avr->data[MCUSR_ADDRESS] = PORF;
+
+		usbHostInit();
+		if (!usbHostAttach(100, &low))
+		{
+			fprintf(stderr, "core stopped\n");
+			exit(1);
+		}
+		attached = avr->cycle;
+		if (usbHostEnumerate() != 0)
+		{
+			fprintf(stderr, "enumeration failed\n");
+			exit(1);
+		}
+		calibration = avr->data[OSCCAL_ADDRESS];
+	}
+
+	for (polls = 0; polls < 100 && report == 0; polls++)
+	{
+		len = usbHostIn(USBHOST_ADDRESS, 1, data);
+		if (len >= 0)
+		{
+			report = avr->cycle;
+		}
+		else if (len != USBHOST_NAK)
+		{
+			fprintf(stderr, "interrupt transfer failed\n");
+			exit(1);
+		}
+		for (i = 0; i < POLL_FRAMES; i++)
+		{
+			usbHostWaitFrame();
+		}
+	}
+
+	printf("%8.1f %8.1f ", simCyclesToUs(attached - simUsToCycles(100000)) / 1000,
+		simCyclesToUs(attached) / 1000);
+	if (rc && simOsccalWrite != 0)
+	{
+		printf("%10.1f ", simCyclesToUs(simOsccalWrite) / 1000);
+	}
+	else
+	{
+		printf("%10s ", "-");
+	}
+	printf("%10.1f ", simCyclesToUs(usbHostConfigured) / 1000);
+	if (report != 0)
+	{
+		printf("%8.1f\n", simCyclesToUs(report) / 1000);
+	}
+	else
+	{
+		printf("%8s\n", "-");
+	}
+}
+
+/* ------------------------------------------------------------------------- */
+
+static unsigned ladderKeys;         /* LADDER_KEYS of the firmware */
+
+/* keyState of main.c, two bytes with more than 8 keys */
+static unsigned readKeyState(uint32_t address)
+{
+	if (2 * ladderKeys > 8)
+	{
+		return avr->data[address] | avr->data[address + 1] << 8;
+	}
+	return avr->data[address];
+}
+
+/* USE_KEY_LADDER: every DEBOUNCE_MS plus 1 to 3 ms another key (or none)
+ * on one of the ladders, at a level up to a quarter of a step off.  Shows
+ * the time from the voltage step until the debounced keys show it, and how
+ * often they showed a third state on the way.
+ */
+static void scenarioLadder(void)
+{
+	uint32_t keyState = simSymbol("keyState");
+	unsigned current[2];
+	unsigned ladder, expected = 0, before, now;
+	unsigned long i, glitches = 0;
+	struct stats latency = { 0 };
+	avr_cycle_count_t start;
+	double level;
+	int glitched;
+
+	ladderKeys = simSymbol("sim_LADDER_KEYS");
+	current[0] = current[1] = ladderKeys; /* no key on either ladder */
+	simSetAnalog(0, 1.0);
+	simSetAnalog(1, 1.0);
+	simRun(simUsToCycles(BOOT_MS * 1000.0));
+
+	for (i = 0; i < iterations; i++)
+	{
+		simRun(simUsToCycles((DEBOUNCE_MS + 1) * 1000.0) + randomNumber(simUsToCycles(2000)));
+
+		ladder = randomNumber(2);
+		current[ladder] = (current[ladder] + 1 + randomNumber(ladderKeys)) % (ladderKeys + 1);
+		level = (current[ladder] + (randomNumber(1001) - 500.0) / 2000) / ladderKeys;
+		level = level < 0 ? 0 : level > 1 ? 1 : level;
+
+		before = expected;
+		expected = 0;
+		if (current[0] != ladderKeys)
+		{
+			expected |= 1 << current[0];
+		}
+		if (current[1] != ladderKeys)
+		{
+			expected |= 1 << (current[1] + ladderKeys);
+		}
+
+		simSetAnalog(ladder, level);
+		start = avr->cycle;
+		glitched = 0;
+		while ((now = readKeyState(keyState)) != expected)
+		{
+			if (now != before)
+			{
+				glitched = 1;
+			}
+			if (avr->cycle - start > simUsToCycles(20000) || !simStep())
+			{
+				fprintf(stderr, "ladder %u key %u not decoded\n", ladder, current[ladder]);
+				exit(1);
+			}
+		}
+		glitches += glitched;
+		statsAdd(&latency, simCyclesToUs(avr->cycle - start));
+	}
+
+	printf("%-28s %10s %10s %10s\n", "", "min", "avg", "max");
+	statsPrint("level step to key", &latency, "us");
+	printf("%-28s %10lu of %lu\n", "wrong keys on the way", glitches, iterations);
+}
+
+/* ------------------------------------------------------------------------- */
+
+#define REPORT_ID_PEDAL 2
+#define PEDAL_BUTTON    1           /* index of button 2 for simSetAnalog() */
+#define SWEEP_MS        1000        /* full travel of the pedal */
+
+/* USE_PEDAL_AXIS: the host polls every POLL_FRAMES ms, first for "iterations"
+ * polls with the pedal resting at half travel and a little noise on it, then
+ * while it is pushed down over SWEEP_MS and released the same way.  Shows
+ * the pedal reports per second and how far behind the pedal they are.
+ */
+static void scenarioPedal(void)
+{
+	uint8_t report[8];
+	unsigned long i, frames, reports;
+	struct stats lag = { 0 };
+	double level, position;
+	int len, frame;
+
+	simSetAnalog(PEDAL_BUTTON, 0.5);
+	bootAndEnumerate();
+
+	/* resting, noise of about one 8 bit count */
+	reports = 0;
+	for (i = 0; i < iterations; i++)
+	{
+		for (frame = 0; frame < POLL_FRAMES; frame++)
+		{
+			simSetAnalog(PEDAL_BUTTON, 0.5 + (randomNumber(1001) - 500.0) / 125000);
+			usbHostWaitFrame();
+		}
+		len = usbHostIn(USBHOST_ADDRESS, 1, report);
+		if (len == 2 && report[0] == REPORT_ID_PEDAL)
+		{
+			reports++;
+		}
+	}
+	printf("%-28s %10.1f\n", "pedal reports/s resting", reports * 1000.0 / (iterations * POLL_FRAMES));
+
+	/* down and up again, the lag is the distance to the pedal in ms of travel */
+	reports = 0;
+	for (frames = 0; frames < 2 * SWEEP_MS; frames++)
+	{
+		position = frames < SWEEP_MS ? (double)frames / SWEEP_MS : 2 - (double)frames / SWEEP_MS;
+		simSetAnalog(PEDAL_BUTTON, position);
+		usbHostWaitFrame();
+		if (frames % POLL_FRAMES != POLL_FRAMES - 1)
+		{
+			continue;
+		}
+		len = usbHostIn(USBHOST_ADDRESS, 1, report);
+		if (len != 2 || report[0] != REPORT_ID_PEDAL)
+		{
+			continue;
+		}
+		reports++;
+		level = report[1] / 255.0;
+		if (level > 0.02 && level < 0.98)
+		{
+			statsAdd(&lag, fabs(position - level) * SWEEP_MS);
+		}
+	}
+	printf("%-28s %10.1f\n", "pedal reports/s sweeping", reports * 1000.0 / (2 * SWEEP_MS));
+	printf("%-28s %10s %10s %10s\n", "", "min", "avg", "max");
+	statsPrint("report behind the pedal", &lag, "ms");
+	printf("%-28s %10lu timeouts, %lu errors, %lu retries\n",
+		"bus", usbHostStats.timeouts, usbHostStats.errors, usbHostStats.retries);
+	printTaskMisses();
+}
+
+/* ------------------------------------------------------------------------- */
+
+/* USE_RAPID_TRIGGER: the Hall switch on button 1 moves by up to 24 ADC
+ * counts every 1 to 2 ms.  A model of the firmware decision tells when
+ * KEY1 has to change: shows the time from the move until keyState shows
+ * it, and the changes that should not have happened.
+ */
+static void scenarioRapid(void)
+{
+	uint32_t keyState = simSymbol("keyState");
+	unsigned long i, wrong = 0;
+	int travel = 0, extreme = 0, down = 0, before;
+	int actuation, press, release;
+	struct stats latency = { 0 };
+	avr_cycle_count_t start;
+
+	simSetAnalog(0, 0.5 / 256);
+	simRun(simUsToCycles(BOOT_MS * 1000.0));
+	/* the settings rapidInit() ended up with, defaults or from EEPROM */
+	actuation = avr->data[simSymbol("rapidActuation")];
+	press = avr->data[simSymbol("rapidPress")];
+	release = avr->data[simSymbol("rapidRelease")];
+
+	for (i = 0; i < iterations; i++)
+	{
+		travel += (int)randomNumber(49) - 24;
+		travel = travel < 0 ? 0 : travel > 255 ? 255 : travel;
+
+		before = down;
+		if (travel < actuation)
+		{
+			down = 0;
+			extreme = 0;
+		}
+		else if (down ? extreme - travel >= release : travel - extreme >= press)
+		{
+			down = !down;
+			extreme = travel;
+		}
+		else if (down ? travel > extreme : travel < extreme)
+		{
+			extreme = travel;
+		}
+
+		simSetAnalog(0, (travel + 0.5) / 256);
+		start = avr->cycle;
+		if (down != before)
+		{
+			while ((avr->data[keyState] & KEY1) != (down ? KEY1 : 0))
+			{
+				if (avr->cycle - start > simUsToCycles(2000) || !simStep())
+				{
+					fprintf(stderr, "travel %d: key not %s\n", travel, down ? "pressed" : "released");
+					exit(1);
+				}
+			}
+			statsAdd(&latency, simCyclesToUs(avr->cycle - start));
+		}
+		simRun(simUsToCycles(1000) + randomNumber(simUsToCycles(1000)) - (avr->cycle - start));
+		if ((avr->data[keyState] & KEY1) != (down ? KEY1 : 0))
+		{
+			wrong++;
+		}
+	}
+
+	printf("%-28s %10.1f us\n", "one conversion", 13 * 64 * 1e6 / coreClock);
+	printf("%-28s %10s %10s %10s\n", "", "min", "avg", "max");
+	statsPrint("move to keyState", &latency, "us");
+	printf("%-28s %10lu of %lu moves\n", "wrong key state", wrong, iterations);
+	printTaskMisses();
+}
+
+/* ------------------------------------------------------------------------- */
+
+/* tap-hold configuration of main.c */
+#define TAPPING_TERM_MS ((int)simSymbol("sim_TAPPING_TERM"))
+#define MOD_CONTROL_LEFT (1<<0)
+
+static uint8_t hostReport[3];       /* what the host last got */
+
+/* wait for the next frame and poll in it */
+static void pollFrame(void)
+{
+	uint8_t report[8];
+
+	if (!usbHostWaitFrame())
+	{
+		fprintf(stderr, "core stopped\n");
+		exit(1);
+	}
+	if (usbHostIn(USBHOST_ADDRESS, 1, report) == 3)
+	{
+		memcpy(hostReport, report, 3);
+	}
+}
+
+/* Poll every frame until the report satisfies "done", returns the ms it
+ * took or -1 after a second.
+ */
+static int pollUntil(int (*done)(const uint8_t *report))
+{
+	int ms;
+
+	for (ms = 0; ms < 1000; ms++)
+	{
+		if (done(hostReport))
+		{
+			return ms;
+		}
+		pollFrame();
+	}
+	return -1;
+}
+
+static int hasKey(const uint8_t *report, uint8_t key)
+{
+	return report[1] == key || report[2] == key;
+}
+
+static int isEmpty(const uint8_t *report)         { return !report[0] && !report[1] && !report[2]; }
+static int hasEnter(const uint8_t *report)        { return hasKey(report, KEY_ENTER); }
+static int hasCtrl(const uint8_t *report)         { return report[0] & MOD_CONTROL_LEFT; }
+
+/* keep the keys for ms, polling every frame */
+static void holdFor(int ms)
+{
+	while (ms-- > 0)
+	{
+		pollFrame();
+	}
+}
+
+/* USE_TAP_HOLD: the host polls every frame while the keys are
+ *  - tapped: button 2 for 30 ms up to 50 ms short of the tapping term, the
+ *    time from the release until Enter arrives
+ *  - held: button 1 beyond the term, the time from the press until Ctrl
+ *    arrives
+ *  - nested: button 1 down, button 2 tapped, button 1 up again within the
+ *    term, the time from the release of button 2 until Enter arrives and
+ *    whether it came with Ctrl
+ */
+static void scenarioTapHold(void)
+{
+	struct stats tap = { 0 }, hold = { 0 }, nested = { 0 };
+	unsigned long i, withCtrl = 0;
+	int ms;
+
+	bootAndEnumerate();
+
+	for (i = 0; i < iterations; i++)
+	{
+		simSetKeys(KEY2);
+		holdFor(30 + randomNumber(TAPPING_TERM_MS - 80));
+		simSetKeys(0);
+		if ((ms = pollUntil(hasEnter)) < 0)
+		{
+			fprintf(stderr, "tap %lu not reported\n", i);
+			exit(1);
+		}
+		statsAdd(&tap, ms);
+		pollUntil(isEmpty);
+		holdFor(50);
+
+		simSetKeys(KEY1);
+		if ((ms = pollUntil(hasCtrl)) < 0)
+		{
+			fprintf(stderr, "hold %lu not reported\n", i);
+			exit(1);
+		}
+		statsAdd(&hold, ms);
+		holdFor(TAPPING_TERM_MS + 50 - ms);
+		simSetKeys(0);
+		pollUntil(isEmpty);
+		holdFor(50);
+
+		simSetKeys(KEY1);
+		holdFor(20 + randomNumber(40));
+		simSetKeys(KEY1 | KEY2);
+		holdFor(20 + randomNumber(40));
+		simSetKeys(KEY1);
+		if ((ms = pollUntil(hasEnter)) < 0)
+		{
+			fprintf(stderr, "nested tap %lu not reported\n", i);
+			exit(1);
+		}
+		statsAdd(&nested, ms);
+		withCtrl += hasCtrl(hostReport) != 0;
+		holdFor(10);
+		simSetKeys(0);
+		holdFor(50); /* a tap of button 1 if it was not taken as hold */
+		pollUntil(isEmpty);
+	}
+
+	printf("%-28s %10s %10s %10s\n", "", "min", "avg", "max");
+	statsPrint("tap: release to Enter", &tap, "ms");
+	statsPrint("hold: press to Ctrl", &hold, "ms");
+	statsPrint("nested: release to Enter", &nested, "ms");
+	printf("%-28s %10lu of %lu\n", "nested taps with Ctrl", withCtrl, iterations);
+	printTaskMisses();
+}
+
+/* ------------------------------------------------------------------------- */
+
+/* chord binding of main.c: Ctrl+Shift+M */
+#define MOD_SHIFT_LEFT  (1<<1)
+#define KEY_M           16
+
+static int hasGui(const uint8_t *report)          { return report[0] & MOD_GUI_LEFT; }
+static int hasChord(const uint8_t *report)
+{
+	return (report[0] & (MOD_CONTROL_LEFT | MOD_SHIFT_LEFT)) == (MOD_CONTROL_LEFT | MOD_SHIFT_LEFT) && hasKey(report, KEY_M);
+}
+
+/* USE_CHORDS: the host polls every frame.  First the delay of a single
+ * press of button 1 until the host sees it, then for several gaps between
+ * pressing button 1 and button 2: how often that made a chord, how often
+ * button 1 was reported before and taken back, and the time from the
+ * second press until the chord arrived.
+ */
+static void scenarioChord(void)
+{
+	static const int gaps[] = { 0, 2, 4, 6, 8, 10, 20, 40, 60 };
+	struct stats single = { 0 }, chord;
+	unsigned long i, chords, retracted;
+	unsigned g;
+	int ms, seenFirst;
+
+	bootAndEnumerate();
+
+	for (i = 0; i < iterations; i++)
+	{
+		simRun(randomNumber(simUsToCycles(1000)));
+		simSetKeys(KEY1);
+		if ((ms = pollUntil(hasGui)) < 0)
+		{
+			fprintf(stderr, "press %lu not reported\n", i);
+			exit(1);
+		}
+		statsAdd(&single, ms);
+		holdFor(30);
+		simSetKeys(0);
+		pollUntil(isEmpty);
+		holdFor(30);
+	}
+	printf("%-28s %10s %10s %10s\n", "", "min", "avg", "max");
+	statsPrint("single press to report", &single, "ms");
+
+	printf("\n%-10s %10s %10s %10s %10s %10s\n", "gap ms", "chords", "retracted", "min ms", "avg ms", "max ms");
+	for (g = 0; g < sizeof(gaps) / sizeof(gaps[0]); g++)
+	{
+		memset(&chord, 0, sizeof(chord));
+		chords = retracted = 0;
+		for (i = 0; i < iterations; i++)
+		{
+			simRun(randomNumber(simUsToCycles(1000)));
+			simSetKeys(KEY1);
+			seenFirst = 0;
+			for (ms = 0; ms < gaps[g]; ms++)
+			{
+				pollFrame();
+				seenFirst |= hasGui(hostReport) != 0;
+			}
+			simSetKeys(KEY1 | KEY2);
+			ms = pollUntil(hasChord);
+			if (ms >= 0)
+			{
+				chords++;
+				retracted += seenFirst;
+				statsAdd(&chord, ms);
+			}
+			simSetKeys(0);
+			pollUntil(isEmpty);
+			holdFor(30);
+		}
+		printf("%-10d %10lu %10lu", gaps[g], chords, retracted);
+		if (chords != 0)
+		{
+			printf(" %10.1f %10.1f %10.1f\n", chord.min, chord.sum / chord.count, chord.max);
+		}
+		else
+		{
+			printf(" %10s %10s %10s\n", "-", "-", "-");
+		}
+	}
+	printTaskMisses();
+}
+
+/* ------------------------------------------------------------------------- */
+
+/* Hold button 2 for "iterations" polls, the host polling every POLL_FRAMES
+ * ms plus up to "late" ms.  Prints the press rate the host saw, collects
+ * the times from the first press to the second and between the later ones.
+ */
+static void turboRun(int late, struct stats *first, struct stats *period)
+{
+	uint8_t report[8];
+	unsigned long i, presses = 0;
+	avr_cycle_count_t start = avr->cycle, last = 0;
+	int down = 0, frame, frames;
+
+	simSetKeys(KEY2);
+	for (i = 0; i < iterations; i++)
+	{
+		frames = POLL_FRAMES + (late ? (int)randomNumber(late + 1) : 0);
+		for (frame = 0; frame < frames; frame++)
+		{
+			usbHostWaitFrame();
+		}
+		if (usbHostIn(USBHOST_ADDRESS, 1, report) != 3)
+		{
+			continue;
+		}
+		if (hasEnter(report) && !down)
+		{
+			if (presses == 1)
+			{
+				statsAdd(first, simCyclesToUs(avr->cycle - last) / 1000);
+			}
+			else if (presses > 1)
+			{
+				statsAdd(period, simCyclesToUs(avr->cycle - last) / 1000);
+			}
+			presses++;
+			last = avr->cycle;
+		}
+		down = hasEnter(report) != 0;
+	}
+	simSetKeys(0);
+	for (frame = 0; frame < 5 * POLL_FRAMES; frame++)
+	{
+		usbHostWaitFrame();
+		usbHostIn(USBHOST_ADDRESS, 1, report);
+	}
+	if (presses < 2)
+	{
+		fprintf(stderr, "no repeated presses\n");
+		exit(1);
+	}
+	printf("%-28s %10.1f presses/s\n", "rate", (presses - 1) * 1e6 / simCyclesToUs(last - start));
+}
+
+/* USE_TURBO: button 2 held while the host polls every POLL_FRAMES ms, and
+ * again with a host polling up to 5 ms late.  Shows the press rate the
+ * host sees, the time from the first to the second press (REPEAT_DELAY for
+ * a repeat key) and the spacing of the following ones.
+ */
+static void scenarioTurbo(void)
+{
+	static const int lateness[] = { 0, 5 };
+	struct stats first, period;
+	unsigned i;
+
+	bootAndEnumerate();
+
+	for (i = 0; i < sizeof(lateness) / sizeof(lateness[0]); i++)
+	{
+		memset(&first, 0, sizeof(first));
+		memset(&period, 0, sizeof(period));
+		printf("%shost polling up to %d ms late\n", i ? "\n" : "", lateness[i]);
+		turboRun(lateness[i], &first, &period);
+		printf("%-28s %10s %10s %10s\n", "", "min", "avg", "max");
+		statsPrint("first to second press", &first, "ms");
+		statsPrint("press to press", &period, "ms");
+	}
+	printf("%-28s %10lu\n", "dropped by data toggle", usbHostStats.dropped);
+	printTaskMisses();
+}
+
+/* ------------------------------------------------------------------------- */
+
+#define HANG_MS         ((int)simSymbol("sim_HANG_TIME1"))
+
+/* reports the host gets in "ms" frames, polling every frame */
+static unsigned long countReports(int ms)
+{
+	uint8_t report[8];
+	unsigned long reports = 0;
+
+	while (ms-- > 0)
+	{
+		usbHostWaitFrame();
+		if (usbHostIn(USBHOST_ADDRESS, 1, report) == 3)
+		{
+			memcpy(hostReport, report, 3);
+			reports++;
+		}
+	}
+	return reports;
+}
+
+/* USE_HANG: the host polls every frame.  Button 1 is released after
+ * 100 ms: the time until the host sees the release.  Then it is released
+ * and pressed again within the hang time: the reports the host got from
+ * the release until 50 ms after the new press, which should be none.
+ */
+static void scenarioHang(void)
+{
+	struct stats release = { 0 };
+	unsigned long i, extra = 0;
+	int ms;
+
+	bootAndEnumerate();
+
+	for (i = 0; i < iterations; i++)
+	{
+		simSetKeys(KEY1);
+		pollUntil(hasGui);
+		holdFor(100);
+		simSetKeys(0);
+		if ((ms = pollUntil(isEmpty)) < 0)
+		{
+			fprintf(stderr, "release %lu not reported\n", i);
+			exit(1);
+		}
+		statsAdd(&release, ms);
+		holdFor(50);
+
+		simSetKeys(KEY1);
+		pollUntil(hasGui);
+		holdFor(100);
+		simSetKeys(0);
+		extra += countReports(20 + randomNumber(HANG_MS - 70));
+		simSetKeys(KEY1);
+		extra += countReports(50);
+		simSetKeys(0);
+		pollUntil(isEmpty);
+		holdFor(50);
+	}
+
+	printf("%-28s %10s %10s %10s\n", "", "min", "avg", "max");
+	statsPrint("release to report", &release, "ms");
+	printf("%-28s %10lu in %lu re-presses\n", "reports during the hang", extra, iterations);
+	printTaskMisses();
+}
+
+/* ------------------------------------------------------------------------- */
+
+#define MULTI_TAP_MS    ((int)simSymbol("sim_MULTI_TAP_WINDOW"))
+#define KEY_1           30
+#define KEY_BACKSPACE   42
+
+static char multiText[8];           /* what the host typed in this series */
+static int multiLen;
+static unsigned long multiUndos;
+
+/* poll a frame and type what is new in the report like the host would */
+static void multiFrame(void)
+{
+	uint8_t prev[3];
+	int i;
+
+	memcpy(prev, hostReport, 3);
+	pollFrame();
+	for (i = 1; i < 3; i++)
+	{
+		uint8_t key = hostReport[i];
+
+		if (key == 0 || hasKey(prev, key))
+		{
+			continue;
+		}
+		if (key == KEY_BACKSPACE)
+		{
+			multiUndos++;
+			multiLen -= multiLen > 0;
+		}
+		else if (key >= KEY_1 && key < KEY_1 + 3 && multiLen < (int)sizeof(multiText))
+		{
+			multiText[multiLen++] = '1' + key - KEY_1;
+		}
+	}
+}
+
+/* USE_MULTI_TAP: the host polls every frame while button 2 is tapped once,
+ * twice and three times, 40 ms down and 80 ms up.  Per tap count: the time
+ * from the last press until its digit arrives, the undos sent on the way
+ * and the series that did not leave exactly that digit typed.
+ */
+static void scenarioMultiTap(void)
+{
+	struct stats latency;
+	unsigned long i, wrong;
+	int taps, t, ms;
+
+	bootAndEnumerate();
+
+	printf("%-6s %10s %10s %10s %10s %10s\n", "taps", "undos", "wrong", "min ms", "avg ms", "max ms");
+	for (taps = 1; taps <= 3; taps++)
+	{
+		memset(&latency, 0, sizeof(latency));
+		multiUndos = wrong = 0;
+		for (i = 0; i < iterations; i++)
+		{
+			multiLen = 0;
+			simRun(randomNumber(simUsToCycles(1000)));
+			for (t = 1; t < taps; t++)
+			{
+				simSetKeys(KEY2);
+				for (ms = 0; ms < 40; ms++)
+				{
+					multiFrame();
+				}
+				simSetKeys(0);
+				for (ms = 0; ms < 80; ms++)
+				{
+					multiFrame();
+				}
+			}
+			simSetKeys(KEY2);
+			for (ms = 0; ms < 1000; ms++)
+			{
+				if (ms == 40)
+				{
+					simSetKeys(0);
+				}
+				if (hasKey(hostReport, KEY_1 + taps - 1))
+				{
+					break;
+				}
+				multiFrame();
+			}
+			if (ms == 1000)
+			{
+				fprintf(stderr, "%d taps not reported\n", taps);
+				exit(1);
+			}
+			statsAdd(&latency, ms);
+			simSetKeys(0);
+			for (ms = 0; ms < MULTI_TAP_MS + 100; ms++)
+			{
+				multiFrame();
+			}
+			wrong += multiLen != 1 || multiText[0] != '0' + taps;
+		}
+		printf("%-6d %10lu %10lu %10.1f %10.1f %10.1f\n", taps, multiUndos, wrong,
+			latency.min, latency.sum / latency.count, latency.max);
+	}
+	printTaskMisses();
+}
+
+/* ------------------------------------------------------------------------- */
+
+#define PROFILE_SWITCH_MS ((int)simSymbol("sim_KEYMAP_SWITCH_TICKS"))
+#define KEY_PAGEUP      75
+#define KEY_LEFT        80
+
+/* button 1 in profile n of main.c's keymapTable */
+static int profileKey1(const uint8_t *report, int n)
+{
+	switch (n)
+	{
+	case 0:  return report[0] == MOD_GUI_LEFT && !report[1];
+	case 1:  return hasChord(report);
+	case 2:  return !report[0] && hasKey(report, KEY_LEFT);
+	default: return !report[0] && hasKey(report, KEY_PAGEUP);
+	}
+}
+
+static int profileWanted;
+static int profileDone(const uint8_t *report) { return profileKey1(report, profileWanted); }
+
+/* USE_PROFILES: plugged in with button 2 held, which selects profile 2
+ * and must stay silent.  Then both buttons are held beyond the switch
+ * time over and over, cycling the profiles: the reports while the buttons
+ * are still held after a switch (should be none) and the time from the
+ * next press of button 1 to its binding in the new profile.
+ */
+static void scenarioProfile(void)
+{
+	struct stats press = { 0 };
+	unsigned long i, held = 0, wrong = 0;
+	int ms, reports;
+
+	simInit(elfFile, symFile, coreClock);
+	avr->data[MCUSR_ADDRESS] = PORF;
+	simSetKeys(KEY2);
+	bootAndEnumerate();
+	reports = countReports(200) != 0 && !isEmpty(hostReport);
+	simSetKeys(0);
+	holdFor(50);
+	printf("%-28s %10s\n", "button held at plug-in", reports ? "REPORTED" : "silent");
+
+	profileWanted = 2;
+	for (i = 0; i < iterations; i++)
+	{
+		simRun(randomNumber(simUsToCycles(1000)));
+		simSetKeys(KEY1);
+		if ((ms = pollUntil(profileDone)) < 0)
+		{
+			wrong++;
+		}
+		else
+		{
+			statsAdd(&press, ms);
+		}
+		holdFor(30);
+		simSetKeys(0);
+		pollUntil(isEmpty);
+		holdFor(30);
+
+		simSetKeys(KEY1 | KEY2);
+		holdFor(PROFILE_SWITCH_MS + 20);
+		held += countReports(100) != 0 && !isEmpty(hostReport);
+		simSetKeys(0);
+		holdFor(30);
+		profileWanted = (profileWanted + 1) % 4;
+	}
+
+	printf("%-28s %10s %10s %10s\n", "", "min", "avg", "max");
+	statsPrint("press to new binding", &press, "ms");
+	printf("%-28s %10lu in %lu switches\n", "held keys reported", held, iterations);
+	printf("%-28s %10lu\n", "wrong bindings", wrong);
+	printTaskMisses();
+}
+
+/* ------------------------------------------------------------------------- */
+
+#define PORTB_ADDRESS   0x38        /* data space addresses */
+#define DDRB_ADDRESS    0x37
+#define OCR0A_ADDRESS   0x49
+#define TCCR0A_ADDRESS  0x4a
+#define COM0A_BITS      0xc0
+#define LED_BIT         0
+
+/* share of the full LED current right now: PB0 sinking the LED, or
+ * connected to Timer0 in inverting PWM for USE_LED_PWM
+ */
+static double ledCurrent(void)
+{
+	if (avr->data[TCCR0A_ADDRESS] & COM0A_BITS)
+	{
+		return (avr->data[OCR0A_ADDRESS] + 1) / 256.0;
+	}
+	if ((avr->data[DDRB_ADDRESS] & ~avr->data[PORTB_ADDRESS]) & (1 << LED_BIT))
+	{
+		return 1.0;
+	}
+	return 0.0;
+}
+
+/* ms until the LED reaches (on) or leaves (!on) any current, with or
+ * without the host on the bus, -1 after a second
+ */
+static int ledUntil(int on, int bus)
+{
+	int ms;
+
+	for (ms = 0; ms < 1000; ms++)
+	{
+		if ((ledCurrent() != 0) == on)
+		{
+			return ms;
+		}
+		if (bus)
+		{
+			pollFrame();
+		}
+		else
+		{
+			simRun(simUsToCycles(1000));
+		}
+	}
+	return -1;
+}
+
+/* LED current while button 1 is held with the host polling every frame,
+ * the share of the time the core is awake meanwhile, and how long the LED
+ * keeps burning after the host suspends the bus (stops all traffic) and
+ * comes back on when it resumes.  Runs "iterations" times.
+ */
+static void scenarioLed(void)
+{
+	struct stats off = { 0 }, on = { 0 };
+	avr_cycle_count_t start, slept;
+	double current = 0;
+	unsigned long i, lit = 0;
+	int ms;
+
+	bootAndEnumerate();
+
+	start = avr->cycle;
+	slept = simSleepCycles;
+	for (i = 0; i < iterations; i++)
+	{
+		simSetKeys(KEY1);
+		for (ms = 0; ms < 200; ms++)
+		{
+			pollFrame();
+			current += ledCurrent();
+		}
+
+		/* suspend with the pedal still down */
+		usbHostSuspend(1);
+		if ((ms = ledUntil(0, 0)) >= 0)
+		{
+			statsAdd(&off, ms);
+		}
+		else
+		{
+			lit++;
+		}
+		simRun(simUsToCycles(50000));
+		usbHostSuspend(0);
+		if ((ms = ledUntil(1, 1)) >= 0)
+		{
+			statsAdd(&on, ms);
+		}
+		simSetKeys(0);
+		holdFor(50);
+	}
+
+	printf("%-28s %9.1f%%\n", "LED current, key held", 100.0 * current / (iterations * 200));
+	printf("%-28s %9.1f%%\n", "awake", 100.0 - 100.0 * (simSleepCycles - slept) / (avr->cycle - start));
+	printf("%-28s %10s %10s %10s\n", "", "min", "avg", "max");
+	statsPrint("suspend to LED off", &off, "ms");
+	statsPrint("resume to LED on", &on, "ms");
+	printf("%-28s %10lu in %lu suspends\n", "LED left on", lit, iterations);
+	printTaskMisses();
+}
+
+/* ------------------------------------------------------------------------- */
+
+/* Button 1 pressed and released in turn every 20 ms, the host polling
+ * right after each keep-alive: the report length, and per report the bus
+ * time of the IN transaction carrying it, the cycles of the USB interrupt
+ * for it and the time from the key change.  For the keyboard against
+ * USE_GAMEPAD.
+ */
+static void scenarioTransfer(void)
+{
+	struct stats bus = { 0 }, isr = { 0 }, latency = { 0 };
+	avr_cycle_count_t start, isrStart;
+	uint8_t report[8];
+	unsigned long i;
+	int len = 0, ms;
+
+	bootAndEnumerate();
+
+	for (i = 0; i < iterations; i++)
+	{
+		simSetKeys(i & 1 ? 0 : KEY1);
+		for (ms = 0; ms < 20; ms++)
+		{
+			usbHostWaitFrame();
+			start = avr->cycle;
+			isrStart = simIsrCycles;
+			len = usbHostIn(USBHOST_ADDRESS, 1, report);
+			if (len > 0)
+			{
+				statsAdd(&bus, simCyclesToUs(avr->cycle - start));
+				statsAdd(&isr, simIsrCycles - isrStart);
+				statsAdd(&latency, ms);
+				break;
+			}
+		}
+		if (len <= 0)
+		{
+			fprintf(stderr, "change %lu not reported\n", i);
+			exit(1);
+		}
+		holdFor(20 - ms);
+	}
+
+	printf("%-28s %10d bytes\n", "report", len);
+	printf("%-28s %10s %10s %10s\n", "", "min", "avg", "max");
+	statsPrint("IN transaction on the bus", &bus, "us");
+	statsPrint("USB interrupt per report", &isr, "cycles");
+	statsPrint("key change to report", &latency, "ms");
+	printTaskMisses();
+}
+
+/* ------------------------------------------------------------------------- */
+
+#define EEPROM_INTERVAL simSymbol("sim_EEPROM_INTERVAL")
+
+/* USE_EEPROM_INTERVAL: for every poll interval in EEPROM, an erased byte
+ * first, the bInterval the host reads from the configuration descriptor.
+ * The host then polls every bInterval frames like it asks for while
+ *  - button 1 changes at a random time every 50 ms: time from the change
+ *    to the report ("iterations" changes)
+ *  - button 1 changes every 6 ms, faster than any report: reports per
+ *    second, the cadence the host actually gets
+ */
+static void scenarioCadence(void)
+{
+	static const uint8_t settings[] = { 0xff, 1, 2, 4, 8, 16, 32 };
+	struct stats latency;
+	uint8_t report[8];
+	unsigned long i, reports;
+	unsigned s;
+	int ms, frame, keys;
+
+	printf("%-8s %10s %10s %10s %10s %12s\n", "EEPROM", "bInterval", "min ms", "avg ms", "max ms", "reports/s");
+	for (s = 0; s < sizeof(settings) / sizeof(settings[0]); s++)
+	{
+		simInit(elfFile, symFile, coreClock);
+		simSetEeprom(EEPROM_INTERVAL, settings[s]);
+		avr->data[MCUSR_ADDRESS] = PORF;
+		bootAndEnumerate();
+		if (usbHostInterval == 0)
+		{
+			fprintf(stderr, "no interrupt endpoint\n");
+			exit(1);
+		}
+
+		memset(&latency, 0, sizeof(latency));
+		keys = 0;
+		for (i = 0; i < iterations; i++)
+		{
+			simRun(randomNumber(simUsToCycles(1000)));
+			keys ^= KEY1;
+			simSetKeys(keys);
+			for (ms = 0, frame = 0; ms < 1000; ms++)
+			{
+				usbHostWaitFrame();
+				if (++frame < usbHostInterval)
+				{
+					continue;
+				}
+				frame = 0;
+				if (usbHostIn(USBHOST_ADDRESS, 1, report) == 3 && reportKeys(report) == keys)
+				{
+					break;
+				}
+			}
+			statsAdd(&latency, ms);
+			for (ms = 0; ms < 50; ms++)
+			{
+				usbHostWaitFrame();
+				if (++frame >= usbHostInterval)
+				{
+					frame = 0;
+					usbHostIn(USBHOST_ADDRESS, 1, report);
+				}
+			}
+		}
+
+		reports = 0;
+		for (ms = 0; ms < 1000; ms++)
+		{
+			if (ms % 6 == 0)
+			{
+				keys ^= KEY1;
+				simSetKeys(keys);
+			}
+			usbHostWaitFrame();
+			if (++frame >= usbHostInterval)
+			{
+				frame = 0;
+				reports += usbHostIn(USBHOST_ADDRESS, 1, report) == 3;
+			}
+		}
+
+		if (settings[s] == 0xff)
+		{
+			printf("%-8s", "erased");
+		}
+		else
+		{
+			printf("%-8u", settings[s]);
+		}
+		printf(" %10d %10.1f %10.1f %10.1f %12lu\n", usbHostInterval,
+			latency.min, latency.sum / latency.count, latency.max, reports);
+	}
+}
+
+/* ------------------------------------------------------------------------- */
+
+static const struct scenario
+{
+	const char *name;
+	void (*run)(void);
+	const char *help;
+} scenarios[] =
+{
+	{ "arm",         scenarioArm,         "cycles from key change to armed interrupt packet" },
+	{ "poll",        scenarioPoll,        "report age and turnaround with a host polling every 10 ms" },
+	{ "duty",        scenarioDuty,        "share of the time the core is awake with a polling host" },
+	{ "storm",       scenarioStorm,       "one row: USB interrupt cycles per transaction, idle, worst\n"
+	                                      "report latency, stale reports and enumeration time in a\n"
+	                                      "storm of key changes" },
+	{ "tolerance",   scenarioTolerance,   "sweep of the core clock error: enumeration, retries, reports" },
+	{ "calibration", scenarioCalibration, "sweep of the RC oscillator spread with OSCCAL calibration" },
+	{ "boot",        scenarioBoot,        "reset to configured device and first report with a key\n"
+	                                      "held while plugging in, for every reset cause" },
+	{ "startup",     scenarioStartup,     "one row: connect, attached, calibrated, configured and\n"
+	                                      "first report in ms after a power-on reset" },
+	{ "ladder",      scenarioLadder,      "USE_KEY_LADDER: latency of the ladder decoding" },
+	{ "pedal",       scenarioPedal,       "USE_PEDAL_AXIS: report rate resting and sweeping, lag of the axis" },
+	{ "rapid",       scenarioRapid,       "USE_RAPID_TRIGGER: latency of the Hall switch decision" },
+	{ "taphold",     scenarioTapHold,     "USE_TAP_HOLD: decision latency of taps, holds and nested taps" },
+	{ "chord",       scenarioChord,       "USE_CHORDS: single press delay, chords and retractions by gap" },
+	{ "turbo",       scenarioTurbo,       "USE_TURBO: press rate and spacing seen by the host" },
+	{ "hang",        scenarioHang,        "USE_HANG: release delay, reports for a re-press within it" },
+	{ "multitap",    scenarioMultiTap,    "USE_MULTI_TAP: latency per tap count, undos, wrong results" },
+	{ "profile",     scenarioProfile,     "USE_PROFILES: plug-in selection, switching, new bindings" },
+	{ "led",         scenarioLed,         "LED current with a key held, LED in suspend and resume" },
+	{ "transfer",    scenarioTransfer,    "report length, bus time and USB interrupt cycles per report" },
+	{ "cadence",     scenarioCadence,     "USE_EEPROM_INTERVAL: latency and report rate per bInterval" },
+};
+
+#define SCENARIO_COUNT  (sizeof(scenarios) / sizeof(scenarios[0]))
+
+static void usage(void)
+{
+	const char *help, *end;
+	unsigned i;
+
+	fprintf(stderr,
+		"usage: tasta-sim [-f main.elf] [-s main.sym] [-c clock] [-n iterations] scenario\n"
+		"\n"
+		"scenarios:\n");
+	for (i = 0; i < SCENARIO_COUNT; i++)
+	{
+		/* continuation lines of the help line up with the first one */
+		fprintf(stderr, "  %-12s", scenarios[i].name);
+		for (help = scenarios[i].help; (end = strchr(help, '\n')) != NULL; help = end + 1)
+		{
+			fprintf(stderr, "%.*s\n%14s", (int)(end - help), help, "");
+		}
+		fprintf(stderr, "%s\n", help);
+	}
+	exit(1);
+}
+
+int main(int argc, char **argv)
+{
+	const struct scenario *scenario;
+	int opt;
+
+	while ((opt = getopt(argc, argv, "f:s:c:n:")) != -1)
+	{
+		switch (opt)
+		{
+		case 'f':
+			elfFile = optarg;
+			break;
+		case 's':
+			symFile = optarg;
+			break;
+		case 'c':
+			coreClock = strtoul(optarg, NULL, 0);
+			break;
+		case 'n':
+			iterations = strtoul(optarg, NULL, 0);
+			break;
+		default:
+			usage();
+		}
+	}
+	if (optind != argc - 1)
+	{
+		usage();
+	}
+
+	for (scenario = scenarios; scenario < scenarios + SCENARIO_COUNT; scenario++)
+	{
+		if (strcmp(argv[optind], scenario->name) == 0)
+		{
+			break;
+		}
+	}
+	if (scenario == scenarios + SCENARIO_COUNT)
+	{
+		usage();
+	}
+
+	simInit(elfFile, symFile, coreClock);
+	scenario->run();
+	return 0;
+}
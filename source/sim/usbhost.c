@@ -0,0 +1,800 @@
+/*
+ * tasta - simple USB keyboard for ATtiny85
+ * Copyright (C) 2015 Christian Garbs <mitch@cgarbs.de>
+ * Licensed under GNU GPL v2 or v3
+ *
+ * usbhost.c - bit level low speed USB host for the simulated firmware
+ *
+ * We drive D+/D- through the pin IRQs of simavr with the exact bit timing
+ * of a low speed host (1.5 Mbit/s, NRZI, bit stuffing) and read back what
+ * the device sends by watching PORTB/DDRB after every instruction.  All
+ * line changes are simavr cycle timers, so a sleeping core is woken up by
+ * them just like the real one.
+ */
+
+#include <stdio.h>
+#include <string.h>
+
+#include "sim_avr.h"
+#include "sim_cycle_timers.h"
+
+#include "sim.h"
+#include "usbhost.h"
+
+#define USBMASK         ((1 << DMINUS_BIT) | (1 << DPLUS_BIT))
+
+#define DDRB_ADDRESS    0x37        /* data space addresses on the ATtiny85 */
+#define PORTB_ADDRESS   0x38
+
+#define LOW_SPEED_BPS   1500000.0
+
+#define TIMEOUT_BITS    18          /* host timeout for the device's answer */
+#define GAP_BITS        2           /* our inter packet delay */
+#define RETRIES         3           /* tries per transaction on errors */
+
+/* line states */
+#define SE0             0
+#define LINE_J          1
+#define LINE_K          2
+#define SE1             3
+
+struct usbHostStats usbHostStats;
+
+avr_cycle_count_t usbHostFrameStart;
+avr_cycle_count_t usbHostLastSop;
+double usbHostLastTurnaround;
+avr_cycle_count_t usbHostConfigured;
+int usbHostInterval;
+
+static unsigned long frame;
+static int resetting;
+static int detached;                /* port disabled while waiting for the device */
+static int suspended;               /* no traffic at all, see usbHostSuspend() */
+static uint8_t inToggle;            /* data PID expected next from the interrupt endpoint */
+
+/* ------------------------------------------------------------------------- */
+
+double usbHostBitCycles(void)
+{
+	return avr->frequency / LOW_SPEED_BPS;
+}
+
+static avr_cycle_count_t frameCycles(void)
+{
+	return simUsToCycles(1000);
+}
+
+static void driveLines(int level)
+{
+	simSetLines(level == LINE_K, level == LINE_J);
+}
+
+/* -------------------------------- transmit ------------------------------- */
+
+#define MAX_EVENTS      512
+
+struct lineEvent
+{
+	avr_cycle_count_t cycle;
+	int level;
+};
+
+static struct lineEvent txEvents[MAX_EVENTS];
+static int txCount, txPos, txLevel;
+static double txBits;
+static avr_cycle_count_t txBase;
+static volatile int txIdle = 1;
+static avr_cycle_count_t txEopEnd;
+
+static avr_cycle_count_t txTimer(avr_t *core, avr_cycle_count_t when, void *param)
+{
+	int level = txEvents[txPos].level;
+
+	if (level == LINE_J && txPos > 0 && txEvents[txPos - 1].level == SE0)
+	{
+		txEopEnd = core->cycle;
+	}
+	driveLines(level);
+
+	if (++txPos < txCount)
+	{
+		return txEvents[txPos].cycle;
+	}
+	txIdle = 1;
+	return 0;
+}
+
+static void txBegin(double gapBits)
+{
+	txCount = 0;
+	txBits = 0;
+	txLevel = LINE_J;
+	txBase = avr->cycle + 1 + (avr_cycle_count_t)(gapBits * usbHostBitCycles());
+}
+
+/* one bit time of the given line state */
+static void txAdd(int level)
+{
+	if (level != txLevel && txCount < MAX_EVENTS)
+	{
+		txEvents[txCount].cycle = txBase + (avr_cycle_count_t)(txBits * usbHostBitCycles() + 0.5);
+		txEvents[txCount].level = level;
+		txCount++;
+		txLevel = level;
+	}
+	txBits += 1;
+}
+
+static void txStart(void)
+{
+	txPos = 0;
+	txIdle = 0;
+	avr_cycle_timer_register(avr, txEvents[0].cycle - avr->cycle, txTimer, NULL);
+}
+
+static void txPacket(const uint8_t *bytes, int len, double gapBits)
+{
+	int i, bit, ones = 0;
+	int level = LINE_J;
+	uint8_t byte;
+
+	txBegin(gapBits);
+	for (i = -1; i < len; i++)
+	{
+		byte = (i < 0) ? 0x80 : bytes[i];   /* sync pattern first */
+		for (bit = 0; bit < 8; bit++)
+		{
+			if (byte & (1 << bit))
+			{
+				txAdd(level);
+				if (++ones == 6)
+				{
+					level = (level == LINE_J) ? LINE_K : LINE_J;
+					txAdd(level);
+					ones = 0;
+				}
+			}
+			else
+			{
+				level = (level == LINE_J) ? LINE_K : LINE_J;
+				txAdd(level);
+				ones = 0;
+			}
+		}
+	}
+	txAdd(SE0);
+	txAdd(SE0);
+	txAdd(LINE_J);
+	txStart();
+}
+
+/* send a packet and wait until the bus is idle again */
+static int send(const uint8_t *bytes, int len, double gapBits)
+{
+	txPacket(bytes, len, gapBits);
+	return simRunUntil(&txIdle, frameCycles()) != 0 || txIdle;
+}
+
+/* -------------------------------- receive -------------------------------- */
+
+#define MAX_EDGES       512
+
+static struct lineEvent rxEdges[MAX_EDGES];
+static int rxCount, rxCapturing, rxWanted, rxLen;
+static volatile int rxDone;
+static uint8_t rxPacket[16];
+
+static int deviceLevel(void)
+{
+	uint8_t port = avr->data[PORTB_ADDRESS];
+	int dplus = (port >> DPLUS_BIT) & 1;
+	int dminus = (port >> DMINUS_BIT) & 1;
+
+	if (dplus)
+	{
+		return dminus ? SE1 : LINE_K;
+	}
+	return dminus ? LINE_J : SE0;
+}
+
+/* NRZI decoding and bit unstuffing of the captured line states */
+static int rxDecode(void)
+{
+	double cpb = usbHostBitCycles();
+	int i, n, bit, bits = 0, ones = 0, prev = LINE_J, started = 0;
+	uint8_t sync = 0;
+
+	rxLen = 0;
+	for (i = 0; i + 1 < rxCount; i++)
+	{
+		int level = rxEdges[i].level;
+
+		n = (int)((rxEdges[i + 1].cycle - rxEdges[i].cycle) / cpb + 0.5);
+		if (!started)
+		{
+			if (level != LINE_K)
+			{
+				continue;
+			}
+			started = 1;
+			usbHostLastSop = rxEdges[i].cycle;
+		}
+		if (level == SE0)
+		{
+			/* EOP must end a byte, the sync byte is 0x80 */
+			if (bits % 8 != 0 || bits < 16 || sync != 0x80)
+			{
+				return USBHOST_ERROR;
+			}
+			return rxLen;
+		}
+		if (level == SE1)
+		{
+			return USBHOST_ERROR;
+		}
+		while (n-- > 0)
+		{
+			bit = (level == prev);
+			prev = level;
+			if (ones == 6)
+			{
+				/* stuffed bit, must be a transition */
+				if (bit)
+				{
+					return USBHOST_ERROR;
+				}
+				ones = 0;
+				continue;
+			}
+			ones = bit ? ones + 1 : 0;
+			if (bits < 8)
+			{
+				sync |= bit << bits;
+			}
+			else if ((bits - 8) / 8 < (int)sizeof(rxPacket))
+			{
+				if ((bits - 8) % 8 == 0)
+				{
+					rxPacket[rxLen++] = 0;
+				}
+				rxPacket[rxLen - 1] |= bit << ((bits - 8) % 8);
+			}
+			else
+			{
+				return USBHOST_ERROR;
+			}
+			bits++;
+		}
+	}
+	return USBHOST_ERROR;       /* no EOP */
+}
+
+static void usbStep(void)
+{
+	int level;
+
+	if ((avr->data[DDRB_ADDRESS] & USBMASK) != USBMASK)
+	{
+		if (rxCapturing)
+		{
+			/* device released the bus: packet is complete */
+			rxCapturing = 0;
+			if (rxCount < MAX_EDGES)
+			{
+				rxEdges[rxCount].cycle = avr->cycle;
+				rxEdges[rxCount].level = -1;
+				rxCount++;
+			}
+			if (rxWanted)
+			{
+				rxLen = rxDecode();
+				rxDone = 1;
+			}
+		}
+		return;
+	}
+
+	if (!rxCapturing)
+	{
+		rxCapturing = 1;
+		rxCount = 0;
+	}
+	level = deviceLevel();
+	if ((rxCount == 0 || rxEdges[rxCount - 1].level != level) && rxCount < MAX_EDGES - 1)
+	{
+		rxEdges[rxCount].cycle = avr->cycle;
+		rxEdges[rxCount].level = level;
+		rxCount++;
+	}
+}
+
+/* wait for the device's answer, returns length including PID or USBHOST_* */
+static int receive(uint8_t *packet)
+{
+	avr_cycle_count_t deadline = txEopEnd + (avr_cycle_count_t)(TIMEOUT_BITS * usbHostBitCycles());
+
+	rxWanted = 1;
+	rxDone = 0;
+	while (!rxDone)
+	{
+		if (!rxCapturing && avr->cycle > deadline)
+		{
+			rxWanted = 0;
+			usbHostStats.timeouts++;
+			return USBHOST_TIMEOUT;
+		}
+		if (!simStep())
+		{
+			rxWanted = 0;
+			return USBHOST_TIMEOUT;
+		}
+	}
+	rxWanted = 0;
+
+	if (rxLen < 1)
+	{
+		usbHostStats.errors++;
+		return USBHOST_ERROR;
+	}
+
+	usbHostLastTurnaround = (usbHostLastSop - txEopEnd) / usbHostBitCycles();
+	if (usbHostLastTurnaround > usbHostStats.maxTurnaround)
+	{
+		usbHostStats.maxTurnaround = usbHostLastTurnaround;
+	}
+
+	memcpy(packet, rxPacket, rxLen);
+	return rxLen;
+}
+
+/* ------------------------------- frames ---------------------------------- */
+
+static avr_cycle_count_t keepAliveTimer(avr_t *core, avr_cycle_count_t when, void *param)
+{
+	if (!resetting && !detached && !suspended && txIdle && !rxCapturing)
+	{
+		/* low speed keep-alive: just an EOP */
+		txBegin(0);
+		txAdd(SE0);
+		txAdd(SE0);
+		txAdd(LINE_J);
+		txStart();
+	}
+	usbHostFrameStart = when;
+	usbHostStats.frames++;
+	frame++;
+	return when + frameCycles();
+}
+
+void usbHostInit(void)
+{
+	/* start from scratch, the benchmarks may reload the core */
+	memset(&usbHostStats, 0, sizeof(usbHostStats));
+	frame = 0;
+	resetting = 0;
+	detached = 0;
+	suspended = 0;
+	txIdle = 1;
+	rxCapturing = 0;
+	rxWanted = 0;
+	inToggle = USBPID_DATA0;
+	usbHostConfigured = 0;
+	usbHostInterval = 0;
+	simStepHook = usbStep;
+	driveLines(LINE_J);
+	avr_cycle_timer_register(avr, frameCycles(), keepAliveTimer, NULL);
+}
+
+void usbHostSuspend(int on)
+{
+	suspended = on;
+}
+
+unsigned long usbHostFrame(void)
+{
+	return frame;
+}
+
+int usbHostWaitFrame(void)
+{
+	unsigned long current = frame;
+
+	while (frame == current || !txIdle)
+	{
+		if (!simStep())
+		{
+			return 0;
+		}
+	}
+	return 1;
+}
+
+/* make sure a transaction of the given length fits before the next frame */
+static int waitForBits(int bits)
+{
+	avr_cycle_count_t needed = (avr_cycle_count_t)(bits * usbHostBitCycles());
+
+	if (avr->cycle + needed >= usbHostFrameStart + frameCycles())
+	{
+		return usbHostWaitFrame();
+	}
+	while (!txIdle)
+	{
+		if (!simStep())
+		{
+			return 0;
+		}
+	}
+	return 1;
+}
+
+/* the device pulls D- low with D+ released: usbDeviceDisconnect() */
+static int deviceDisconnected(void)
+{
+	return (avr->data[DDRB_ADDRESS] & USBMASK) == (1 << DMINUS_BIT)
+		&& !(avr->data[PORTB_ADDRESS] & (1 << DMINUS_BIT));
+}
+
+int usbHostAttach(double debounceMs, avr_cycle_count_t *low)
+{
+	avr_cycle_count_t debounce = simUsToCycles(debounceMs * 1000);
+	avr_cycle_count_t since = avr->cycle, before;
+	int disconnected;
+
+	*low = 0;
+	detached = 1;
+	while (avr->cycle - since < debounce)
+	{
+		before = avr->cycle;
+		disconnected = deviceDisconnected();
+		if (!simStep())
+		{
+			return 0;
+		}
+		if (disconnected)
+		{
+			*low += avr->cycle - before;
+			since = avr->cycle;
+		}
+	}
+	detached = 0;
+	return 1;
+}
+
+void usbHostBusReset(double ms)
+{
+	resetting = 1;
+	txBegin(0);
+	txAdd(SE0);
+	txBits += ms * LOW_SPEED_BPS / 1000 - 1;
+	txAdd(LINE_J);
+	txStart();
+	simRunUntil(&txIdle, simUsToCycles(ms * 1000 + 1000));
+	resetting = 0;
+}
+
+/* ----------------------------- transactions ------------------------------ */
+
+static uint8_t crc5(uint16_t data)
+{
+	uint8_t crc = 0x1f;
+	int i;
+
+	for (i = 0; i < 11; i++)
+	{
+		if ((crc ^ (data >> i)) & 1)
+		{
+			crc = (crc >> 1) ^ 0x14;
+		}
+		else
+		{
+			crc >>= 1;
+		}
+	}
+	return ~crc & 0x1f;
+}
+
+static uint16_t crc16(const uint8_t *data, int len)
+{
+	uint16_t crc = 0xffff;
+	int i;
+
+	while (len-- > 0)
+	{
+		crc ^= *data++;
+		for (i = 0; i < 8; i++)
+		{
+			crc = (crc & 1) ? (crc >> 1) ^ 0xa001 : crc >> 1;
+		}
+	}
+	return ~crc;
+}
+
+static int sendToken(uint8_t pid, uint8_t address, uint8_t endpoint)
+{
+	uint16_t value = (address & 0x7f) | ((endpoint & 0x0f) << 7);
+	uint8_t token[3];
+
+	token[0] = pid;
+	token[1] = value & 0xff;
+	token[2] = (value >> 8) | (crc5(value) << 3);
+	return send(token, sizeof(token), 0);
+}
+
+static int sendData(uint8_t pid, const uint8_t *data, int len)
+{
+	uint8_t packet[11];
+	uint16_t crc = crc16(data, len);
+
+	packet[0] = pid;
+	if (len > 0)
+	{
+		memcpy(packet + 1, data, len);
+	}
+	packet[len + 1] = crc & 0xff;
+	packet[len + 2] = crc >> 8;
+	return send(packet, len + 3, GAP_BITS);
+}
+
+static int sendHandshake(uint8_t pid)
+{
+	return send(&pid, 1, GAP_BITS);
+}
+
+int usbHostIn(uint8_t address, uint8_t endpoint, uint8_t *data)
+{
+	uint8_t packet[16];
+	int len = USBHOST_TIMEOUT, try;
+
+	for (try = 0; try < RETRIES; try++)
+	{
+		if (try > 0)
+		{
+			usbHostStats.retries++;
+		}
+		if (!waitForBits(150) || !sendToken(USBPID_IN, address, endpoint))
+		{
+			return USBHOST_TIMEOUT;
+		}
+		usbHostStats.transactions++;
+
+		len = receive(packet);
+		if (len < 0)
+		{
+			continue;
+		}
+		if (packet[0] == USBPID_NAK)
+		{
+			usbHostStats.naks++;
+			return USBHOST_NAK;
+		}
+		if (packet[0] == USBPID_STALL)
+		{
+			return USBHOST_STALL;
+		}
+		if ((packet[0] != USBPID_DATA0 && packet[0] != USBPID_DATA1) || len < 3
+		    || crc16(packet + 1, len - 3) != (packet[len - 2] | (packet[len - 1] << 8)))
+		{
+			usbHostStats.errors++;
+			len = USBHOST_ERROR;
+			continue;
+		}
+		if (len - 3 > 8)
+		{
+			usbHostStats.errors++;
+			return USBHOST_ERROR; /* too long for low speed */
+		}
+		sendHandshake(USBPID_ACK);
+		if (endpoint != 0)
+		{
+			if (packet[0] != inToggle)
+			{
+				usbHostStats.dropped++;
+				return USBHOST_NAK;
+			}
+			inToggle ^= USBPID_DATA0 ^ USBPID_DATA1;
+		}
+		memcpy(data, packet + 1, len - 3);
+		return len - 3;
+	}
+	return len;
+}
+
+/* SETUP or OUT transaction with data, returns 0 on ACK */
+static int out(uint8_t pid, uint8_t dataPid, uint8_t address, const uint8_t *data, int len)
+{
+	uint8_t packet[16];
+	int result = USBHOST_TIMEOUT, try;
+
+	for (try = 0; try < RETRIES; try++)
+	{
+		if (try > 0)
+		{
+			usbHostStats.retries++;
+		}
+		if (!waitForBits(250) || !sendToken(pid, address, 0) || !sendData(dataPid, data, len))
+		{
+			return USBHOST_TIMEOUT;
+		}
+		usbHostStats.transactions++;
+
+		result = receive(packet);
+		if (result < 0)
+		{
+			continue;
+		}
+		if (packet[0] == USBPID_ACK)
+		{
+			return 0;
+		}
+		if (packet[0] == USBPID_NAK)
+		{
+			usbHostStats.naks++;
+			return USBHOST_NAK;
+		}
+		if (packet[0] == USBPID_STALL)
+		{
+			return USBHOST_STALL;
+		}
+		usbHostStats.errors++;
+		result = USBHOST_ERROR;
+	}
+	return result;
+}
+
+/* repeat a NAKed transaction for the given number of frames */
+#define UNTIL_NOT_NAK(result, call, frames)                                    \
+	do                                                                      \
+	{                                                                       \
+		unsigned long until = frame + (frames);                         \
+		while (((result) = (call)) == USBHOST_NAK && frame < until)     \
+		{                                                               \
+			simRun((avr_cycle_count_t)(20 * usbHostBitCycles()));  \
+		}                                                               \
+	}                                                                       \
+	while (0)
+
+int usbHostControl(uint8_t address, const uint8_t setup[8], uint8_t *data, unsigned frames)
+{
+	int result, len = 0, wanted = setup[6] | (setup[7] << 8);
+	uint8_t buffer[8];
+
+	UNTIL_NOT_NAK(result, out(USBPID_SETUP, USBPID_DATA0, address, setup, 8), frames);
+	if (result < 0)
+	{
+		return result;
+	}
+
+	if (setup[0] & 0x80)
+	{
+		/* data stage IN, status stage OUT */
+		while (len < wanted)
+		{
+			UNTIL_NOT_NAK(result, usbHostIn(address, 0, buffer), frames);
+			if (result < 0)
+			{
+				return result;
+			}
+			if (len + result > wanted)
+			{
+				result = wanted - len;
+			}
+			memcpy(data + len, buffer, result);
+			len += result;
+			if (result < 8)
+			{
+				break;
+			}
+		}
+		UNTIL_NOT_NAK(result, out(USBPID_OUT, USBPID_DATA1, address, NULL, 0), frames);
+	}
+	else
+	{
+		/* status stage IN */
+		UNTIL_NOT_NAK(result, usbHostIn(address, 0, buffer), frames);
+	}
+	return result < 0 ? result : len;
+}
+
+/* --------------------------- enumeration --------------------------------- */
+
+#define NAK_FRAMES      200         /* calibration after reset takes a while */
+#define FIRST_TRIES     5           /* tries for the first request after reset ... */
+#define FIRST_WAIT      20          /* ... with these many frames in between */
+
+static void makeSetup(uint8_t *setup, uint8_t type, uint8_t request, uint16_t value, uint16_t index, uint16_t length)
+{
+	setup[0] = type;
+	setup[1] = request;
+	setup[2] = value & 0xff;
+	setup[3] = value >> 8;
+	setup[4] = index & 0xff;
+	setup[5] = index >> 8;
+	setup[6] = length & 0xff;
+	setup[7] = length >> 8;
+}
+
+int usbHostEnumerate(void)
+{
+	uint8_t setup[8], buffer[256];
+	int len, i, j;
+
+	usbHostBusReset(15);
+	for (i = 0; i < 10; i++)   /* reset recovery time */
+	{
+		usbHostWaitFrame();
+	}
+
+	/* GET_DESCRIPTOR device: the device may still be calibrating with
+	 * interrupts off, so try again a few times like real hosts do
+	 */
+	makeSetup(setup, 0x80, 6, 0x0100, 0, 64);
+	for (i = 0; (len = usbHostControl(0, setup, buffer, NAK_FRAMES)) < 8; i++)
+	{
+		if (i == FIRST_TRIES - 1)
+		{
+			return -1;
+		}
+		usbHostStats.retries++;
+		for (j = 0; j < FIRST_WAIT; j++)
+		{
+			usbHostWaitFrame();
+		}
+	}
+
+	/* SET_ADDRESS */
+	makeSetup(setup, 0x00, 5, USBHOST_ADDRESS, 0, 0);
+	if (usbHostControl(0, setup, buffer, NAK_FRAMES) < 0)
+	{
+		return -1;
+	}
+	usbHostWaitFrame();
+	usbHostWaitFrame();
+
+	/* GET_DESCRIPTOR device, configuration (header, then everything) */
+	makeSetup(setup, 0x80, 6, 0x0100, 0, 18);
+	if (usbHostControl(USBHOST_ADDRESS, setup, buffer, NAK_FRAMES) != 18)
+	{
+		return -1;
+	}
+	makeSetup(setup, 0x80, 6, 0x0200, 0, 9);
+	if (usbHostControl(USBHOST_ADDRESS, setup, buffer, NAK_FRAMES) != 9)
+	{
+		return -1;
+	}
+	len = buffer[2] | (buffer[3] << 8);
+	makeSetup(setup, 0x80, 6, 0x0200, 0, len);
+	if (usbHostControl(USBHOST_ADDRESS, setup, buffer, NAK_FRAMES) != len)
+	{
+		return -1;
+	}
+	for (i = 0; i + 6 < len && buffer[i] != 0; i += buffer[i])
+	{
+		if (buffer[i + 1] == 5 && buffer[i + 2] == 0x81) /* endpoint 1 IN */
+		{
+			usbHostInterval = buffer[i + 6];
+		}
+	}
+
+	/* SET_CONFIGURATION, the interrupt endpoint starts with DATA0 */
+	makeSetup(setup, 0x00, 9, 1, 0, 0);
+	if (usbHostControl(USBHOST_ADDRESS, setup, buffer, NAK_FRAMES) < 0)
+	{
+		return -1;
+	}
+	inToggle = USBPID_DATA0;
+	usbHostConfigured = avr->cycle;
+
+	/* HID: SET_IDLE 0, GET_DESCRIPTOR report */
+	makeSetup(setup, 0x21, 0x0a, 0, 0, 0);
+	if (usbHostControl(USBHOST_ADDRESS, setup, buffer, NAK_FRAMES) < 0)
+	{
+		return -1;
+	}
+	makeSetup(setup, 0x81, 6, 0x2200, 0, 255);
+	if (usbHostControl(USBHOST_ADDRESS, setup, buffer, NAK_FRAMES) <= 0)
+	{
+		return -1;
+	}
+	return 0;
+}
@@ -0,0 +1,103 @@
+/*
+ * tasta - simple USB keyboard for ATtiny85
+ * Copyright (C) 2015 Christian Garbs <mitch@cgarbs.de>
+ * Licensed under GNU GPL v2 or v3
+ *
+ * usbhost.h - bit level low speed USB host for the simulated firmware
+ */
+
+#ifndef __usbhost_h_included__
+#define __usbhost_h_included__
+
+#include <stdint.h>
+
+#include "sim_avr.h"
+
+#define USBPID_SETUP    0x2d
+#define USBPID_OUT      0xe1
+#define USBPID_IN       0x69
+#define USBPID_DATA0    0xc3
+#define USBPID_DATA1    0x4b
+#define USBPID_ACK      0xd2
+#define USBPID_NAK      0x5a
+#define USBPID_STALL    0x1e
+
+/* results of a transaction */
+#define USBHOST_NAK     (-1)
+#define USBHOST_STALL   (-2)
+#define USBHOST_TIMEOUT (-3)        /* no answer from the device */
+#define USBHOST_ERROR   (-4)        /* garbled answer: CRC, bit stuffing, ... */
+
+struct usbHostStats
+{
+	unsigned long frames;           /* keep-alive EOPs sent */
+	unsigned long transactions;
+	unsigned long timeouts;
+	unsigned long errors;
+	unsigned long retries;          /* transactions repeated after timeout or error */
+	unsigned long naks;
+	unsigned long dropped;          /* interrupt packets with the wrong data toggle */
+	double maxTurnaround;           /* bit times from our EOP to the device's SOP */
+};
+
+extern struct usbHostStats usbHostStats;
+
+#define USBHOST_ADDRESS 1           /* given to the device by usbHostEnumerate() */
+
+/* the device must start its answer within 6.5 bit times after our EOP */
+#define USBHOST_MAX_TURNAROUND  6.5
+
+/* cycle of the last keep-alive EOP and of the last device SOP */
+extern avr_cycle_count_t usbHostFrameStart;
+extern avr_cycle_count_t usbHostLastSop;
+
+/* cycle at the end of SET_CONFIGURATION, 0 before */
+extern avr_cycle_count_t usbHostConfigured;
+
+/* bInterval of endpoint 1 from the configuration descriptor, 0 before */
+extern int usbHostInterval;
+
+/* bit times from our EOP to the device's SOP in the last transaction */
+extern double usbHostLastTurnaround;
+
+/* register with the simulator, starts 1 ms keep-alives */
+void usbHostInit(void);
+
+/* stop all traffic, keep-alives included, or go on again; the frames
+ * still count.  The resume signalling is left out, V-USB ignores it.
+ */
+void usbHostSuspend(int on);
+
+/* current frame number (counts keep-alives) */
+unsigned long usbHostFrame(void);
+
+/* wait for the start of the next frame, returns 0 if the core died */
+int usbHostWaitFrame(void);
+
+/* wait until the device has stopped pulling D- low for the given time, like
+ * a hub debouncing an attach; no keep-alives meanwhile.  Stores the cycles
+ * the device pulled D- low, returns 0 if the core died.
+ */
+int usbHostAttach(double debounceMs, avr_cycle_count_t *low);
+
+/* drive SE0 for the given time */
+void usbHostBusReset(double ms);
+
+/* interrupt or bulk IN transaction, returns length of data or USBHOST_*;
+ * like a real host, a packet with the wrong data toggle on an endpoint
+ * other than 0 is acknowledged and dropped (counted, returns USBHOST_NAK)
+ */
+int usbHostIn(uint8_t address, uint8_t endpoint, uint8_t *data);
+
+/* control transfer with optional IN data stage, retries NAKs up to the
+ * given number of frames, returns length of data or USBHOST_*
+ */
+int usbHostControl(uint8_t address, const uint8_t setup[8], uint8_t *data, unsigned frames);
+
+/* full enumeration as a typical host does it, returns 0 when configured */
+int usbHostEnumerate(void);
+
+/* bit time in cycles at the current core clock */
+double usbHostBitCycles(void);
+
+#endif /* __usbhost_h_included__ */
@@ -26,14 +26,23 @@
  * This may be any bit in the port. Please note that D+ must also be connected
  * to interrupt pin INT0!
  */
-#define USB_CFG_CLOCK_KHZ       16500
-/* Clock rate of the AVR in MHz. Legal values are 12000, 16000 or 16500.
+#define USB_CFG_CLOCK_KHZ       (F_CPU/1000)
+/* We take the clock from F_OSC in the Makefile: 16500 (PLL) or 12800 (RC
+ * oscillator only). The crystal clocks are only used in the simulator.
+ * Clock rate of the AVR in MHz. Legal values are 12000, 16000 or 16500.
  * The 16.5 MHz version of the code requires no crystal, it tolerates +/- 1%
  * deviation from the nominal frequency. All other rates require a precision
  * of 2000 ppm and thus a crystal!
  * Default if not specified: 12 MHz
  */
 
+#define USB_CFG_CHECK_CRC       (USB_CFG_CLOCK_KHZ == 18000)
+/* Define this to 1 if you want that the driver checks integrity of incoming
+ * data packets (CRC checks). CRC checks cost quite a bit of code size and are
+ * currently only available for 18 MHz crystal clock. You must choose
+ * USB_CFG_CLOCK_KHZ = 18000 if you enable this option.
+ */
+
 /* ----------------------- Optional Hardware Config ------------------------ */
 
 /* #define USB_CFG_PULLUP_IOPORTNAME   D */
@@ -103,7 +112,7 @@
 #ifndef __ASSEMBLER__
 extern void usbEventResetReady(void);
 #endif
-#define USB_RESET_HOOK(isReset)             if(!isReset){usbEventResetReady();}
+#define USB_RESET_HOOK(isReset)             if(!isReset){usbConfiguration = 0; usbEventResetReady();}
 /* This macro is a hook if you need to know when an USB RESET occurs. It has
  * one parameter which distinguishes between the start of RESET state and its
  * end.
@@ -112,6 +121,28 @@ extern void usbEventResetReady(void);
 /* define this macro to 1 if you want the function usbMeasureFrameLength()
  * compiled in. This function can be used to calibrate the AVR's RC oscillator.
  */
+#if USE_JIT_REPORT
+#ifdef __ASSEMBLER__
+macro usbJitReport
+    .global usbJitHook                      ; the link fails without the hook
+usbJitHook:
+    in      r28, PINB                       ; YL = button bits 3 and 4
+    andi    r28, 0x18                       ; = offset of 8 byte packet
+    ori     r28, lo8(reportTable)           ; reportTable is 32 byte aligned
+    ldi     r29, hi8(reportTable)
+    lds     r17, usbTxStatus1 + 1           ; x2 = PID of armed packet
+    st      y, r17
+    endm
+#endif
+#define USB_TX1_PACKET_HOOK                 usbJitReport
+#endif
+/* This macro (if defined) is executed in the assembler module when an IN
+ * token for endpoint 1 arrives and a packet is armed. It must load Y with the
+ * address of the packet to send instead of usbTxBuf1 (the packet length is
+ * taken from usbTxLen1). It may use x2 (r17), but every cycle delays the
+ * answer to the host: the code above takes 6 cycles more than the default.
+ * We send the precomputed packet for the buttons as they are right now.
+ */
 
 /* -------------------------- Device Description --------------------------- */
 
@@ -169,7 +200,13 @@ extern void usbEventResetReady(void);
 /* See USB specification if you want to conform to an existing device class or
  * protocol.
  */
+#if USE_PEDAL_AXIS
+#define USB_CFG_HID_REPORT_DESCRIPTOR_LENGTH    59  /* keyboard and pedal collections */
+#elif USE_GAMEPAD
+#define USB_CFG_HID_REPORT_DESCRIPTOR_LENGTH    23  /* gamepad with 8 buttons */
+#else
 #define USB_CFG_HID_REPORT_DESCRIPTOR_LENGTH    35  /* total length of report descriptor */
+#endif
 /* Define this to the length of the HID report descriptor, if you implement
  * an HID device. Otherwise don't define it or define it to 0.
  * Since this template defines a HID device, it must also specify a HID
@@ -228,13 +265,22 @@ extern void usbEventResetReady(void);
  */
 
 #define USB_CFG_DESCR_PROPS_DEVICE                  0
+#if USE_EEPROM_INTERVAL
+/* in RAM with bInterval from EEPROM, see usbDescriptorConfiguration in main.c */
+#define USB_CFG_DESCR_PROPS_CONFIGURATION           (USB_PROP_IS_DYNAMIC | USB_PROP_IS_RAM)
+#else
 #define USB_CFG_DESCR_PROPS_CONFIGURATION           0
+#endif
 #define USB_CFG_DESCR_PROPS_STRINGS                 0
 #define USB_CFG_DESCR_PROPS_STRING_0                0
 #define USB_CFG_DESCR_PROPS_STRING_VENDOR           0
 #define USB_CFG_DESCR_PROPS_STRING_PRODUCT          0
 #define USB_CFG_DESCR_PROPS_STRING_SERIAL_NUMBER    0
+#if USE_EEPROM_INTERVAL
+#define USB_CFG_DESCR_PROPS_HID                     (USB_PROP_IS_RAM | 9) /* inside the above */
+#else
 #define USB_CFG_DESCR_PROPS_HID                     0
+#endif
 #define USB_CFG_DESCR_PROPS_HID_REPORT              0
 #define USB_CFG_DESCR_PROPS_UNKNOWN                 0
 